@@ -2,31 +2,52 @@
 namespace HieraParser
 {
 
-Alignment *Alignment::CreateFromString(const std::string &line)
+Alignment *Alignment::CreateFromString(const StringPiece &line)
 {
-        const std::vector<std::string> &parts = StringSplit(line, " ||| ");
-        std::string raw;
-        if (parts.size() == 2)
+        static const StringPiece kDelim(" ||| ");
+        if (line.empty())
+                return nullptr;
+        const size_t delim = line.find(kDelim);
+        CHECK(delim != std::string::npos, "#ERROR [Alignment], invalid line: " + line.ToString());
+        StringPiece raw = line.substr(delim + kDelim.size());
+        const size_t next = raw.find(kDelim);
+        if (next != std::string::npos)
+                raw = raw.substr(0, next);
+        if (raw.empty())
+                return nullptr;
+        const StringPiece header = line.substr(0, delim);
+        int sourceSize = 0;
+        CHECK(ParseNonNegative(header.substr(0, header.find('-')), sourceSize),
+              "#ERROR [Alignment], invalid line: " + line.ToString());
+
+        std::vector<std::pair<int, int>> links;
+        PieceSplitter tokens(raw, ' ');
+        StringPiece token;
+        while (tokens.Next(token))
         {
-                if (parts[1].size() == 0)
-                        return nullptr;
+                const size_t dash = token.find('-');
+                int srcId = -1;
+                int trgId = -1;
+                CHECK(dash != std::string::npos &&
+                          ParseNonNegative(token.substr(0, dash), srcId) &&
+                          ParseNonNegative(token.substr(dash + 1), trgId),
+                      "#ERROR [Alignment],  invalid line: " + line.ToString());
+                CHECK(srcId < sourceSize, "#ERROR [Alignment],  invalid line: " + line.ToString());
+                links.emplace_back(srcId, trgId);
         }
-        raw = parts[1];
-        const size_t sourceSize = std::stoul(StringSplit(parts[0], "-")[0]);
+        std::sort(links.begin(), links.end());
+        links.erase(std::unique(links.begin(), links.end()), links.end());
 
-        const std::vector<std::string> &tokens = StringSplit(raw, " ");
-        CHECK(tokens.size() > 0, "#ERROR [Alignment], empty line:" + line);
-        CHECK(tokens[0] != "\n", "#ERROR [Alignment], empty line:" + line);
-        Alignment *ret = new Alignment(sourceSize);
-        for (size_t j = 0; j < tokens.size(); j++)
+        Alignment *ret = new Alignment();
+        ret->offsets_.assign(sourceSize + 1, 0);
+        ret->targets_.reserve(links.size());
+        for (const auto &link : links)
         {
-                const std::vector<std::string> &indices = StringSplit(tokens[j], "-");
-                CHECK(indices.size() == 2, "#ERROR [Alignment],  invalid line: " + line);
-                int srcId = std::stoi(indices[0]);
-                int trgId = std::stoi(indices[1]);
-                CHECK((srcId >= 0) && (srcId < static_cast<int>(sourceSize)), "#ERROR [Alignment],  invalid line: " + line);
-                (*ret)[srcId].insert(trgId);
+                ret->offsets_[link.first + 1]++;
+                ret->targets_.push_back(link.second);
         }
+        for (int i = 0; i < sourceSize; i++)
+                ret->offsets_[i + 1] += ret->offsets_[i];
         return ret;
 }
 } // namespace HieraParser
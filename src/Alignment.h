@@ -2,25 +2,34 @@
 #define ALIGNMENT_H
 
 #include <vector>
-#include <set>
 #include <string>
 #include "utils/StringUtils.h"
+#include "utils/StringPiece.h"
 #include "utils/AssertDef.h"
 namespace HieraParser
 {
-typedef std::vector<std::set<int>> AlignmentTemplate;
 
-class Alignment : public AlignmentTemplate
+// Word alignment of a sentence pair, stored as flat arrays: the target
+// positions aligned to source word i are sorted and unique in
+// [begin(i), end(i)).
+class Alignment
 {
         // alignment object does not allow the input line as empty line.
       public:
-        Alignment() : valid_(false){};
-        Alignment(const size_t &size) : valid_(false) {resize(size);};
+        Alignment(){};
         ~Alignment(){};
-        static Alignment *CreateFromString(const std::string &line);
+        static Alignment *CreateFromString(const StringPiece &line);
+
+        size_t size() const { return offsets_.size() - 1; }
+        bool empty(size_t i) const { return offsets_[i] == offsets_[i + 1]; }
+        const int *begin(size_t i) const { return targets_.data() + offsets_[i]; }
+        const int *end(size_t i) const { return targets_.data() + offsets_[i + 1]; }
+        int Min(size_t i) const { return *begin(i); }
+        int Max(size_t i) const { return *(end(i) - 1); }
 
       private:
-        bool valid_;
+        std::vector<int> offsets_;
+        std::vector<int> targets_;
 };
 } // namespace HieraParser
-#endif
\ No newline at end of file
+#endif
@@ -1,5 +1,9 @@
 #include "BaseModel.h"
 #include "Config.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
 #include <iostream>
 
 namespace HieraParser
@@ -8,13 +12,13 @@ namespace HieraParser
 Model::Model(const Config &cfg)
     // : weights(2, MiniHashMap<uint64_t, float, Hash>(HUGE_VALF)),
     //   cached_weights(2, MiniHashMap<uint64_t, float, Hash>(HUGE_VALF)),
-    : weights(2), cached_weights(2), m_path(cfg.GetString("model"))
+    : m_path(cfg.GetString("model"))
 {
 }
 
-Model::Model() : weights(2), cached_weights(2) {}
+Model::Model() {}
 
-Model::Model(const Model &copy) : weights(copy.weights), cached_weights(copy.cached_weights)
+Model::Model(const Model &copy) : weights(copy.weights)
 {
 }
 
@@ -22,14 +26,23 @@ void Model::ReadModel(const std::string &path)
 {
     std::cerr << "Loading model from " << path << std::endl;
     std::ifstream file(path);
+    uint64_t magic;
+    CHECK(file.read(reinterpret_cast<char *>(&magic), sizeof(magic)),
+          "Error, model file is empty.");
+    const bool legacy = magic != kModelFileMagic;
+    if (legacy)
+    {
+        std::cerr << "Converting the dense features of a model written before "
+                     "them." << std::endl;
+        file.seekg(0);
+    }
     int num = 0;
+    weights.clear();
     for (int i = 0; i < 2; i++)
     {
         size_t size;
         CHECK(file.read(reinterpret_cast<char *>(&size), sizeof(size)),
               "Error, model file is empty.");
-        auto &mapping = weights[i];
-        mapping.clear();
         for (size_t j = 0; j < size; j++)
         {
             size_t feature;
@@ -39,7 +52,7 @@ void Model::ReadModel(const std::string &path)
             float weight;
             CHECK(file.read(reinterpret_cast<char *>(&weight), sizeof(weight)).good(),
                   "Cannot read the model data");
-            mapping[feature] = weight;
+            weights[legacy ? ConvertLegacyFeature(feature) : feature][i] = weight;
             num++;
         }
     }
@@ -49,109 +62,306 @@ void Model::ReadModel(const std::string &path)
 
 void Model::WriteModel(const std::string &path, bool finish) const
 {
+    FlatWeights flat[2];
+    for (int i = 0; i < 2; i++)
+        weights.Flatten(2 + i, flat[i]);
+    WriteModelFile(path, flat);
+}
 
-    std::ofstream file(path);
+void WriteModelFile(const std::string &path, const FlatWeights *cached_weights)
+{
+    // The magic, then for each label the number of entries and the
+    // (feature, weight) pairs, serialized into one buffer and written at once.
+    const size_t kEntrySize = sizeof(size_t) + sizeof(float);
+    std::vector<char> buffer(sizeof(kModelFileMagic) + 2 * sizeof(size_t) +
+                             (cached_weights[0].size() + cached_weights[1].size()) * kEntrySize);
+    char *p = buffer.data();
+    std::memcpy(p, &kModelFileMagic, sizeof(kModelFileMagic));
+    p += sizeof(kModelFileMagic);
     for (int i = 0; i < 2; i++)
     {
-        const auto &mapping = cached_weights[i];
-        const size_t size = mapping.size();
-        CHECK(
-            file.write(reinterpret_cast<const char *>(&size), sizeof(size)).good(),
-            "Cannot write the model data");
-        for (auto it = mapping.begin(); it != mapping.end(); ++it)
+        const size_t size = cached_weights[i].size();
+        std::memcpy(p, &size, sizeof(size));
+        p += sizeof(size);
+        for (const auto &entry : cached_weights[i])
         {
-            const size_t feature = it->first;
-            CHECK(
-                file.write(reinterpret_cast<const char *>(&feature), sizeof(feature))
-                    .good(),
-                "Cannot write the model data");
-            const float weight = it->second;
-            CHECK(file.write(reinterpret_cast<const char *>(&weight), sizeof(weight))
-                      .good(),
-                  "Cannot write the model data");
+            const size_t feature = entry.first;
+            std::memcpy(p, &feature, sizeof(feature));
+            std::memcpy(p + sizeof(feature), &entry.second, sizeof(float));
+            p += kEntrySize;
         }
     }
+    std::ofstream file(path, std::ios::binary);
+    CHECK(file.write(buffer.data(), buffer.size()).good(), "Cannot write the model data");
     file.close();
 }
 void Model::Clear()
 {
-    for (int i = 0; i < 2; i++)
+    weights.clear();
+}
+
+void Model::CopyWeightsToAveraged()
+{
+    for (size_t s = 0; s < Weights::kShards; s++)
+        weights.ForEachIn(s, [](uint64_t, WeightEntry &entry) {
+            for (int i = 0; i < 2; i++)
+                entry[2 + i] = entry[i];
+        });
+}
+
+size_t Model::NumAveraged() const
+{
+    size_t n = 0;
+    weights.ForEach([&n](uint64_t, const WeightEntry &entry) {
+        n += (entry[2] != 0.0) + (entry[3] != 0.0);
+    });
+    return n;
+}
+
+float PruneCutoff(std::vector<float> &magnitudes, size_t target)
+{
+    // Ties with the cutoff are kept, so the result does not depend on the
+    // order of the entries.
+    const size_t size = magnitudes.size();
+    std::nth_element(magnitudes.begin(), magnitudes.begin() + (size - target),
+                     magnitudes.end());
+    return magnitudes[size - target];
+}
+
+size_t Model::Prune(size_t target)
+{
+    const size_t size = weights.size();
+    if (size <= target)
+        return 0;
+    // The dense features cost nothing and are always kept.
+    std::vector<float> magnitudes;
+    magnitudes.reserve(size);
+    for (size_t s = 0; s < Weights::kShards; s++)
+        for (const auto &entry : weights.shard(s))
+            magnitudes.push_back(PruneMagnitude(entry.second));
+    const float cutoff = PruneCutoff(magnitudes, target);
+    size_t dropped = 0;
+    for (size_t s = 0; s < Weights::kShards; s++)
     {
-        weights[i].clear();
-        cached_weights[i].clear();
+        WeightShard &shard = weights.shard(s);
+        for (auto it = shard.begin(); it != shard.end();)
+        {
+            if (PruneMagnitude(it->second) < cutoff)
+            {
+                it = shard.erase(it);
+                dropped++;
+            }
+            else
+                ++it;
+        }
+    }
+    return dropped;
+}
+
+// Run f(s) for every weight shard s, one task per shard on <pool>.
+template <class F>
+static void ForEachShard(ThreadPool *pool, F f)
+{
+    if (pool == nullptr)
+    {
+        for (size_t s = 0; s < Weights::kShards; s++)
+            f(s);
+        return;
     }
+    std::vector<std::future<void>> results;
+    for (size_t s = 0; s < Weights::kShards; s++)
+        results.emplace_back(pool->enqueue([&f, s]() { f(s); }));
+    for (auto &&result : results)
+        result.get();
 }
 
-void Model::ParaMix(std::vector<Model> &submodels, const std::vector<int> &total_updates)
+void Model::ParaMix(std::vector<Model> &submodels, const std::vector<int> &total_updates,
+                    ThreadPool *pool)
 {
     int normalization = 0;
     for (auto &n : total_updates)
         normalization += n;
     Clear();
-    for (size_t j = 0; j < submodels.size(); j++)
+    ForEachShard(pool, [&](size_t s) {
+        for (size_t j = 0; j < submodels.size(); j++)
+        {
+            float rate = float(total_updates[j]) / normalization;
+            const Weights &mapping = submodels[j].weights;
+            mapping.ForEachIn(s, [&](uint64_t feature, const WeightEntry &sub) {
+                WeightEntry &entry = weights[feature];
+                for (int i = 2; i < 4; i++)
+                    entry[i] += sub[i] * rate;
+            });
+        }
+    });
+}
+
+float Model::Score(const std::vector<uint64_t> &features, int label) const
+{
+    float score = 0.0;
+    for (const uint64_t feature : features)
     {
-        float rate = float(total_updates[j]) / normalization;
-        for (size_t i = 0; i < 2; i++)
+        const WeightEntry *entry = weights.Find(feature);
+        if (entry != nullptr)
+            score += (*entry)[label];
+    }
+    return score;
+}
+
+void Model::Scores(const std::vector<uint64_t> &features, float *scores) const
+{
+    scores[0] = scores[1] = 0.0;
+    for (const uint64_t feature : features)
+    {
+        const WeightEntry *entry = weights.Find(feature);
+        if (entry != nullptr)
         {
-            const Weights &mapping = submodels[j].cached_weights[i];
-            for (auto it = mapping.begin(); it != mapping.end(); ++it)
-            {
-                cached_weights[i][it->first] += (it->second) * rate;
-            }
+            scores[0] += (*entry)[0];
+            scores[1] += (*entry)[1];
         }
     }
 }
 
-void Model::IterParaMix(std::vector<Model> &submodels, const std::vector<int> &shardSize, float momentum)
+void FeaturesDiff::AppendShard(const FeaturesDiff &other, size_t shard,
+                               size_t num_shards)
 {
-    int normalization = 0;
-    for (auto &n : shardSize)
-        normalization += n;
-    for (int i = 0; i < 2; i++)
+    for (const DiffEntry &entry : other.entries_)
     {
-        weights[i].clear();
+        if (entry.feature % num_shards == shard)
+            entries_.push_back(entry);
     }
-    for (size_t j = 0; j < submodels.size(); j++)
+}
+
+float FeaturesDiff::Combine()
+{
+    std::sort(entries_.begin(), entries_.end(),
+              [](const DiffEntry &lhs, const DiffEntry &rhs) {
+                  return lhs.feature != rhs.feature ? lhs.feature < rhs.feature
+                                                    : lhs.label < rhs.label;
+              });
+    auto out = entries_.begin();
+    sq_norm_ = 0.0;
+    for (auto it = entries_.begin(); it != entries_.end();)
     {
-        float rate = float(shardSize[j]) / normalization;
-        for (int i = 0; i < 2; i++)
+        DiffEntry sum = *it;
+        for (++it; it != entries_.end() && it->feature == sum.feature &&
+                   it->label == sum.label;
+             ++it)
+            sum.count += it->count;
+        if (sum.count != 0)
         {
-            Weights& sub_cached_weights = submodels[j].cached_weights[i];
-            
-            for (auto it = sub_cached_weights.begin(); it != sub_cached_weights.end(); ++it)
-                cached_weights[i][it->first] +=  (it->second) * rate;
-            
-            sub_cached_weights.clear();
-            Weights &sub_weights = submodels[j].weights[i];
-            for (auto it = sub_weights.begin(); it != sub_weights.end(); ++it)
-                weights[i][it->first] += (it->second) * rate;
-
-            sub_weights.clear();
-            
+            *out++ = sum;
+            sq_norm_ += sum.count * sum.count;
         }
     }
-    for (size_t j = 0; j < submodels.size(); j++)
+    entries_.erase(out, entries_.end());
+    return sq_norm_;
+}
+
+void Model::Update(const FeaturesDiff &featuresDiff, const float &tau, const float &coefficient)
+{
+    for (const DiffEntry &entry : featuresDiff)
+    {
+        const float delta = tau * entry.count;
+        WeightEntry &weight = weights[entry.feature];
+        weight[entry.label] += delta;
+        weight[2 + entry.label] += delta * coefficient;
+    }
+}
+float DeltaModel::Score(const std::vector<uint64_t> &features, int label) const
+{
+    float score = 0.0;
+    for (const uint64_t feature : features)
+    {
+        const WeightEntry *entry = base_->weights.Find(feature);
+        if (entry != nullptr)
+            score += (*entry)[label];
+        if (!Touched(feature))
+            continue;
+        entry = weights.Find(feature);
+        if (entry != nullptr)
+            score += (*entry)[label];
+    }
+    return score;
+}
+
+void DeltaModel::Scores(const std::vector<uint64_t> &features, float *scores) const
+{
+    scores[0] = scores[1] = 0.0;
+    for (const uint64_t feature : features)
     {
-        for (int i = 0; i < 2; i++)
+        const WeightEntry *entry = base_->weights.Find(feature);
+        if (entry != nullptr)
         {
-            submodels[j].weights[i] = Weights(weights[i]);
+            scores[0] += (*entry)[0];
+            scores[1] += (*entry)[1];
         }
+        if (!Touched(feature))
+            continue;
+        entry = weights.Find(feature);
+        if (entry != nullptr)
+        {
+            scores[0] += (*entry)[0];
+            scores[1] += (*entry)[1];
+        }
+    }
+}
+
+void DeltaModel::Update(const FeaturesDiff &featuresDiff, const float &tau, const float &coefficient)
+{
+    Model::Update(featuresDiff, tau, coefficient);
+    const uint64_t mask = (uint64_t(1) << kTouchedBits) - 1;
+    for (const DiffEntry &entry : featuresDiff)
+    {
+        const uint64_t bit = entry.feature & mask;
+        touched_[bit >> 6] |= uint64_t(1) << (bit & 63);
     }
-    // for (int i = 0; i < 2; i++)
-    // {
-    //     cached_weights[i] = Weights(weights[i]);
-    // }
-}
-
-// void Model::Update(const FeaturesDiff &featuresDiff, const float& tau, const float& coefficient)
-// {
-//   for (int i = 0; i < 2; i++) {
-//     for (auto it = featuresDiff[i].begin(); it != featuresDiff[i].end(); ++it) {
-//       if (it->second != 0.0) {
-//         weights[i][it->first] += tau * it->second;
-//         cached_weights[i][it->first] += tau * it->second * coefficient;
-//       }
-//     }
-//   }
-// }
-} // namespace HieraParser
\ No newline at end of file
+}
+
+void DeltaModel::ClearDelta()
+{
+    weights.clear();
+    std::fill(touched_.begin(), touched_.end(), 0);
+}
+
+// Since the shard rates sum to one, the mix sum_j rate_j * (base + delta_j)
+// of the workers' models is base + sum_j rate_j * delta_j, so only the
+// deltas move.
+void MergeDeltas(Model &base, std::vector<DeltaModel> &workers,
+                 const std::vector<int> &shardSize, ThreadPool *pool)
+{
+    int normalization = 0;
+    for (auto &n : shardSize)
+        normalization += n;
+    // The weighted deltas are summed in the delta of the first worker
+    // before they are added to the base, as the processes of NetworkTrainer
+    // mix them, so that both round alike.
+    ForEachShard(pool, [&](size_t s) {
+        Weights &sum = workers[0].weights;
+        const float rate0 = float(shardSize[0]) / normalization;
+        sum.ForEachIn(s, [&](uint64_t, WeightEntry &entry) {
+            for (int i = 0; i < 4; i++)
+                entry[i] *= rate0;
+        });
+        for (size_t j = 1; j < workers.size(); j++)
+        {
+            float rate = float(shardSize[j]) / normalization;
+            Weights &delta = workers[j].weights;
+            delta.ForEachIn(s, [&](uint64_t feature, const WeightEntry &sub) {
+                WeightEntry &entry = sum[feature];
+                for (int i = 0; i < 4; i++)
+                    entry[i] += sub[i] * rate;
+            });
+            delta.clear(s);
+        }
+        sum.ForEachIn(s, [&](uint64_t feature, const WeightEntry &sub) {
+            WeightEntry &entry = base.weights[feature];
+            for (int i = 0; i < 4; i++)
+                entry[i] += sub[i];
+        });
+        sum.clear(s);
+    });
+    for (auto &worker : workers)
+        worker.ClearDelta();
+}
+} // namespace HieraParser
@@ -1,6 +1,9 @@
 #ifndef MODEL_H_
 #define MODEL_H_
 #include "Config.h"
+#include <array>
+#include <cmath>
+#include <memory>
 #include "utils/AssertDef.h"
 #include "utils/ThreadPool.h"
 #include "utils/TypeDef.h"
@@ -18,10 +21,169 @@ struct DummyKeyEqual {
 };
 // typedef std::unordered_map<uint64_t, float> FeatureWeightMapping;
 // typedef std::vector<FeatureWeightMapping> Weights;
-typedef std::unordered_map<uint64_t, float, DummyHash> Weights;
-typedef std::unordered_map<uint64_t, int, DummyHash, DummyKeyEqual> Counts;
+// The weights of STR and INV, then their averaged weights, of a feature.
+typedef std::array<float, 4> WeightEntry;
+typedef std::unordered_map<uint64_t, WeightEntry, DummyHash> WeightShard;
+// The (feature, weight) entries of a weight map as one array.
+typedef std::vector<std::pair<uint64_t, float>> FlatWeights;
+
+// Features below kDenseFeatures are not fingerprints but ids of the
+// templates with small domains (see Parser::ExtractFeatures).
+static const uint64_t kDenseFeatures = 256;
+
+// Feature weights split into kShards hash maps by the top bits of the
+// fingerprint, so that different threads can fill or merge different key
+// ranges of the same weights without locking. The four weights of a
+// feature share one entry, so an update probes one map once; a missing
+// entry and a zero weight are the same. The dense features are kept in an
+// array indexed by the feature instead, which belongs to shard 0.
+class Weights {
+public:
+  static const int kShardBits = 6;
+  static const size_t kShards = static_cast<size_t>(1) << kShardBits;
+  static size_t ShardOf(uint64_t feature) {
+    return static_cast<size_t>(feature >> (64 - kShardBits));
+  }
+
+  Weights() : shards_(kShards) { clear_dense(); };
+  WeightShard &shard(size_t s) { return shards_[s]; }
+  const WeightShard &shard(size_t s) const { return shards_[s]; }
+
+  WeightEntry &operator[](uint64_t feature) {
+    if (feature < kDenseFeatures)
+      return dense_[feature];
+    return shards_[ShardOf(feature)][feature];
+  }
+  // Weights of <feature>, or nullptr if it is not in the map.
+  const WeightEntry *Find(uint64_t feature) const {
+    if (feature < kDenseFeatures)
+      return &dense_[feature];
+    const WeightShard &s = shards_[ShardOf(feature)];
+    if (s.empty())
+      return nullptr;
+    const auto it = s.find(feature);
+    return it == s.end() ? nullptr : &it->second;
+  }
+  // Entries in the maps; the dense features take no memory of their own.
+  size_t size() const {
+    size_t n = 0;
+    for (const auto &s : shards_)
+      n += s.size();
+    return n;
+  }
+  void clear() {
+    for (auto &s : shards_)
+      s.clear();
+    clear_dense();
+  }
+  // Clear shard <s> only.
+  void clear(size_t s) {
+    shards_[s].clear();
+    if (s == 0)
+      clear_dense();
+  }
+  // Set weight <k> of <feature> to zero; the entry goes once all are zero.
+  void erase(uint64_t feature, int k) {
+    if (feature < kDenseFeatures) {
+      dense_[feature][k] = 0.0;
+      return;
+    }
+    WeightShard &s = shards_[ShardOf(feature)];
+    const auto it = s.find(feature);
+    if (it == s.end())
+      return;
+    it->second[k] = 0.0;
+    if (IsZero(it->second))
+      s.erase(it);
+  }
+  // Append the non-zero (feature, weight) entries of weight <k> of the
+  // entries: the weights of STR and INV for 0 and 1, their averaged weights
+  // for 2 and 3.
+  void Flatten(int k, FlatWeights &out) const {
+    ForEach([&out, k](uint64_t feature, const WeightEntry &entry) {
+      if (entry[k] != 0.0)
+        out.emplace_back(feature, entry[k]);
+    });
+  }
+  // Call f(feature, entry) for every entry.
+  template <class F> void ForEach(F f) const {
+    for (size_t s = 0; s < kShards; s++)
+      ForEachIn(s, f);
+  }
+  // Call f(feature, entry) for every entry of shard <s>, where the non-zero
+  // dense entries are in shard 0.
+  template <class F> void ForEachIn(size_t s, F f) const {
+    if (s == 0)
+      for (uint64_t feature = 0; feature < kDenseFeatures; feature++)
+        if (!IsZero(dense_[feature]))
+          f(feature, dense_[feature]);
+    for (const auto &entry : shards_[s])
+      f(entry.first, entry.second);
+  }
+  template <class F> void ForEachIn(size_t s, F f) {
+    if (s == 0)
+      for (uint64_t feature = 0; feature < kDenseFeatures; feature++)
+        if (!IsZero(dense_[feature]))
+          f(feature, dense_[feature]);
+    for (auto &entry : shards_[s])
+      f(entry.first, entry.second);
+  }
+
+private:
+  static bool IsZero(const WeightEntry &entry) {
+    return entry[0] == 0.0 && entry[1] == 0.0 && entry[2] == 0.0 &&
+           entry[3] == 0.0;
+  }
+  void clear_dense() {
+    for (auto &entry : dense_)
+      entry.fill(0.0);
+  }
+
+  std::vector<WeightShard> shards_;
+  std::array<WeightEntry, kDenseFeatures> dense_;
+};
 // typedef std::vector<MiniHashMap<uint64_t, float, DummyHash>> Weights;
-typedef std::vector<Counts> FeaturesDiff;
+
+// <count> times <feature> of <label> (STR or INV).
+struct DiffEntry
+{
+  uint64_t feature;
+  int label;
+  int count;
+};
+
+// Sparse difference of the feature counts of derivations. Entries are
+// appended as they are collected and combined once: sorted by feature and
+// label, with the counts of each pair summed, so that an update visits
+// every weight once. clear() keeps the storage, so a diff reused across
+// examples stops allocating once it has held the largest one.
+class FeaturesDiff
+{
+public:
+  FeaturesDiff() : sq_norm_(0.0){};
+  void Add(uint64_t feature, int label, int count)
+  {
+    entries_.push_back(DiffEntry{feature, label, count});
+  }
+  // Append the entries of <other> with (feature % num_shards) == shard.
+  void AppendShard(const FeaturesDiff &other, size_t shard, size_t num_shards);
+  // Sort and sum the entries, dropping the ones that cancel out; returns the
+  // squared norm, which sq_norm() keeps.
+  float Combine();
+  float sq_norm() const { return sq_norm_; }
+  bool empty() const { return entries_.empty(); }
+  void clear()
+  {
+    entries_.clear();
+    sq_norm_ = 0.0;
+  }
+  std::vector<DiffEntry>::const_iterator begin() const { return entries_.begin(); }
+  std::vector<DiffEntry>::const_iterator end() const { return entries_.end(); }
+
+private:
+  std::vector<DiffEntry> entries_;
+  float sq_norm_;
+};
 
 class Model {
 
@@ -31,24 +193,95 @@ public:
   Model(const Model &copy);
   virtual ~Model(){};
 
-  void WriteModel(const std::string &path, bool cached=true) const;
-  void ReadModel(const std::string &path);
+  virtual void WriteModel(const std::string &path, bool cached=true) const;
+  virtual void ReadModel(const std::string &path);
   void Save() const { WriteModel(m_path); };
   void Clear();
   // void Ensemble(std::vector<Model> &submodels);
-  void ParaMix(std::vector<Model> &submodels,  const std::vector<int>& shardSize);
-  void IterParaMix(std::vector<Model> &submodels,   const std::vector<int>& total_updates, float momentum);
-  // void Update(const FeaturesDiff &featuresDiff, const float& tau, const
-  // float& coefficient);
-  // Weights of features used in training.
-  // // The size of this vector is 2 (STR and INV).
-  // std::vector<MiniHashMap<uint64_t, float, Hash>> weights;
-  // std::vector<MiniHashMap<uint64_t, float, Hash>> cached_weights;
-  std::vector<Weights> weights;
-  std::vector<Weights> cached_weights;
+  // Reduces one shard of the feature space per task on <pool> (serially
+  // if it is null).
+  void ParaMix(std::vector<Model> &submodels,  const std::vector<int>& shardSize,
+               ThreadPool *pool = nullptr);
+  // Sum of the current weights of <features> for <label> (STR or INV).
+  virtual float Score(const std::vector<uint64_t> &features, int label) const;
+  // Both sums of Score, <scores>[label], with one lookup per feature.
+  virtual void Scores(const std::vector<uint64_t> &features, float *scores) const;
+  // Add tau * diff to the weights and tau * diff * coefficient to the
+  // averaged weights; <featuresDiff> is combined.
+  virtual void Update(const FeaturesDiff &featuresDiff, const float &tau,
+                      const float &coefficient);
+  // Start the averaged weights from the current ones.
+  virtual void CopyWeightsToAveraged();
+  // Features with a non-zero averaged weight, counted once per label.
+  size_t NumAveraged() const;
+  // Drop the features with the smallest averaged weights, summed over both
+  // labels, until about <target> are left; returns the number dropped.
+  virtual size_t Prune(size_t target);
+  // Weights of the features used in training.
+  Weights weights;
 
 private:
   std::string m_path;
 };
+
+// The averaged weight sums the updates of a feature scaled by how early they
+// came, so it ranks features by both their weight and their use: pruning
+// drops the entries with the smallest sum of both.
+inline float PruneMagnitude(const WeightEntry &entry)
+{
+  return std::fabs(entry[2]) + std::fabs(entry[3]);
+}
+// The magnitude below which entries go so that about <target> of
+// <magnitudes> are left; reorders <magnitudes>.
+float PruneCutoff(std::vector<float> &magnitudes, size_t target);
+
+// Write a model file, in the format of Model::WriteModel, from the flat
+// averaged weights of both labels.
+void WriteModelFile(const std::string &path, const FlatWeights *cached_weights);
+
+// First 8 bytes of a model file. Files written before the dense features
+// start with their number of entries instead, which is never this large,
+// and keep the dense features under fingerprints like the lexical ones.
+static const uint64_t kModelFileMagic = 0x324C444F4D504948ULL; // "HIPMODL2"
+// The dense feature that a model file without kModelFileMagic stores under
+// <feature>, or <feature> itself. Defined with the templates in Parser.cc.
+uint64_t ConvertLegacyFeature(uint64_t feature);
+
+// A worker's view of a shared, read-only base model: its weights are the
+// base weights plus a sparse delta, and <weights> only holds that delta,
+// with the worker's own averaged updates. A bitmap over
+// the low bits of updated features lets Score skip most delta lookups.
+class DeltaModel : public Model {
+public:
+  DeltaModel() : base_(nullptr), touched_(kTouchedWords, 0){};
+  virtual ~DeltaModel(){};
+  void SetBase(const Model *base) { base_ = base; }
+  float Score(const std::vector<uint64_t> &features, int label) const;
+  void Scores(const std::vector<uint64_t> &features, float *scores) const;
+  void Update(const FeaturesDiff &featuresDiff, const float &tau,
+              const float &coefficient);
+  // A delta is pruned once it is merged into the base.
+  size_t Prune(size_t) { return 0; }
+  // Drop the delta (after it has been merged into the base).
+  void ClearDelta();
+
+protected:
+  static const size_t kTouchedBits = 20;
+  static const size_t kTouchedWords = (size_t(1) << kTouchedBits) / 64;
+  bool Touched(uint64_t feature) const {
+    const uint64_t bit = feature & ((uint64_t(1) << kTouchedBits) - 1);
+    return (touched_[bit >> 6] >> (bit & 63)) & 1;
+  }
+
+private:
+  const Model *base_;
+  std::vector<uint64_t> touched_;
+};
+
+// Merge the deltas of <workers>, weighted by their shard sizes, into the
+// weights of <base> and their averaged updates into its averaged weights,
+// then clear the workers. One task per weight shard on <pool>.
+void MergeDeltas(Model &base, std::vector<DeltaModel> &workers,
+                 const std::vector<int> &shardSize, ThreadPool *pool = nullptr);
 } // namespace HieraParser
 #endif // MODEL_H_
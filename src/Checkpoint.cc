@@ -0,0 +1,380 @@
+#include "Checkpoint.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+namespace HieraParser
+{
+
+// Version 02 stores the dense features under their ids.
+static const char kCheckpointMagic[8] = {'H', 'P', 'C', 'K', 'P', 'T', '0', '2'};
+static const char kSegmentMagic[8] = {'H', 'P', 'C', 'K', 'S', 'E', 'G', '1'};
+static const char kSegmentEnd[8] = {'H', 'P', 'C', 'K', 'E', 'N', 'D', '1'};
+// A weight entry on disk: the feature, then its weight.
+static const size_t kEntrySize = sizeof(uint64_t) + sizeof(float);
+// Checkpoints that may wait for the writer thread before training blocks.
+static const size_t kMaxPending = 2;
+
+struct CheckpointHeader
+{
+  char magic[8];
+  int32_t strategy;
+  int32_t iterations;
+  int32_t examples;
+  int32_t epoch;
+  uint64_t seed;
+  uint64_t num_counters;
+  uint64_t num_models;
+};
+
+// Head of an increment in the log. <bytes> counts what follows up to the
+// end marker: the counters, then for each weight map of each model the
+// changed entries and the removed features, each preceded by its number.
+struct SegmentHeader
+{
+  char magic[8];
+  int32_t epoch;
+  int32_t reserved;
+  uint64_t seed;
+  uint64_t num_counters;
+  uint64_t num_models;
+  uint64_t bytes;
+};
+
+static void Put(std::vector<char> &buffer, const void *data, size_t size)
+{
+  const char *p = static_cast<const char *>(data);
+  buffer.insert(buffer.end(), p, p + size);
+}
+
+static void PutEntries(std::vector<char> &buffer, const FlatWeights &entries)
+{
+  const uint64_t size = entries.size();
+  Put(buffer, &size, sizeof(size));
+  for (const auto &entry : entries)
+  {
+    Put(buffer, &entry.first, sizeof(entry.first));
+    Put(buffer, &entry.second, sizeof(entry.second));
+  }
+}
+
+// Reads fixed-size fields out of a byte range, failing on truncation.
+class Reader
+{
+public:
+  Reader(const char *begin, const char *end, const std::string &path)
+      : p_(begin), end_(end), path_(path){};
+  void Get(void *data, size_t size)
+  {
+    CHECK(size <= static_cast<size_t>(end_ - p_),
+          "Error, checkpoint " + path_ + " is truncated.");
+    std::memcpy(data, p_, size);
+    p_ += size;
+  }
+  uint64_t GetSize()
+  {
+    uint64_t size;
+    Get(&size, sizeof(size));
+    return size;
+  }
+  size_t left() const { return end_ - p_; }
+  const char *position() const { return p_; }
+
+private:
+  const char *p_;
+  const char *end_;
+  const std::string &path_;
+};
+
+static bool ReadFile(const std::string &path, std::vector<char> &data)
+{
+  std::ifstream file(path, std::ios::binary);
+  if (!file.good())
+    return false;
+  data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+  return true;
+}
+
+FlatModel FlattenModel(const Model &model)
+{
+  FlatModel flat(4);
+  for (int k = 0; k < 4; k++)
+    model.weights.Flatten(k, flat[k]);
+  return flat;
+}
+
+bool ReadCheckpoint(const std::string &path, TrainingState &state,
+                    const std::vector<Model *> &models)
+{
+  std::vector<char> data;
+  if (!ReadFile(path, data))
+    return false;
+  Reader snapshot(data.data(), data.data() + data.size(), path);
+  CheckpointHeader header;
+  snapshot.Get(&header, sizeof(header));
+  CHECK(std::memcmp(header.magic, kCheckpointMagic, sizeof(kCheckpointMagic)) == 0,
+        "Error, " + path + " is not a checkpoint, or one written before the "
+        "dense features.");
+  CHECK(header.num_models == models.size(),
+        "Error, the checkpoint " + path + " was written by a different strategy "
+        "or number of threads.");
+  state.strategy = header.strategy;
+  state.iterations = header.iterations;
+  state.examples = header.examples;
+  state.epoch = header.epoch;
+  state.seed = header.seed;
+  state.counters.resize(header.num_counters);
+  snapshot.Get(state.counters.data(), state.counters.size() * sizeof(int));
+  for (Model *model : models)
+  {
+    Weights &weights = model->weights;
+    weights.clear();
+    for (int k = 0; k < 4; k++)
+    {
+      for (uint64_t j = snapshot.GetSize(); j > 0; j--)
+      {
+        uint64_t feature;
+        float weight;
+        snapshot.Get(&feature, sizeof(feature));
+        snapshot.Get(&weight, sizeof(weight));
+        weights[feature][k] = weight;
+      }
+    }
+  }
+
+  // Apply the increments; a crash while appending can only leave the last
+  // one incomplete, without its end marker.
+  int increments = 0;
+  if (ReadFile(path + ".log", data))
+  {
+    Reader log(data.data(), data.data() + data.size(), path + ".log");
+    SegmentHeader segment;
+    while (log.left() >= sizeof(segment))
+    {
+      log.Get(&segment, sizeof(segment));
+      CHECK(std::memcmp(segment.magic, kSegmentMagic, sizeof(kSegmentMagic)) == 0,
+            "Error, the checkpoint log " + path + ".log is corrupt.");
+      if (log.left() < segment.bytes + sizeof(kSegmentEnd) ||
+          std::memcmp(log.position() + segment.bytes, kSegmentEnd,
+                      sizeof(kSegmentEnd)) != 0)
+        break;
+      CHECK(segment.num_models == models.size() &&
+                segment.num_counters == state.counters.size(),
+            "Error, the checkpoint log " + path + ".log does not match " + path);
+      state.epoch = segment.epoch;
+      state.seed = segment.seed;
+      log.Get(state.counters.data(), state.counters.size() * sizeof(int));
+      for (Model *model : models)
+      {
+        Weights &weights = model->weights;
+        for (int k = 0; k < 4; k++)
+        {
+          for (uint64_t j = log.GetSize(); j > 0; j--)
+          {
+            uint64_t feature;
+            float weight;
+            log.Get(&feature, sizeof(feature));
+            log.Get(&weight, sizeof(weight));
+            weights[feature][k] = weight;
+          }
+          for (uint64_t j = log.GetSize(); j > 0; j--)
+          {
+            uint64_t feature;
+            log.Get(&feature, sizeof(feature));
+            weights.erase(feature, k);
+          }
+        }
+      }
+      char end[sizeof(kSegmentEnd)];
+      log.Get(end, sizeof(end));
+      increments++;
+    }
+  }
+  std::cerr << "Resuming from " << path << " (" << increments
+            << " increments) after " << state.epoch << " iterations." << std::endl;
+  return true;
+}
+
+CheckpointWriter::CheckpointWriter()
+    : busy_(false), stop_(false), snapshot_bytes_(0), log_bytes_(0),
+      thread_(&CheckpointWriter::Run, this){};
+
+CheckpointWriter::~CheckpointWriter()
+{
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  changed_.notify_all();
+  thread_.join();
+}
+
+void CheckpointWriter::SaveCheckpoint(const std::string &path,
+                                      const TrainingState &state,
+                                      std::vector<FlatModel> &&models)
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  // Bound the snapshots held in memory if the disk cannot keep up.
+  changed_.wait(lock, [this] { return jobs_.size() < kMaxPending; });
+  jobs_.push_back(Job{path, true, state, std::move(models)});
+  changed_.notify_all();
+}
+
+void CheckpointWriter::SaveModel(const std::string &path,
+                                 std::vector<FlatWeights> &&cached_weights)
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  changed_.wait(lock, [this] { return jobs_.size() < kMaxPending; });
+  jobs_.push_back(Job{path, false, TrainingState(),
+                      std::vector<FlatModel>(1, std::move(cached_weights))});
+  changed_.notify_all();
+}
+
+void CheckpointWriter::Flush()
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  changed_.wait(lock, [this] { return jobs_.empty() && !busy_; });
+}
+
+void CheckpointWriter::Run()
+{
+  while (true)
+  {
+    Job job;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      changed_.wait(lock, [this] { return stop_ || !jobs_.empty(); });
+      if (jobs_.empty())
+        return;
+      job = std::move(jobs_.front());
+      jobs_.pop_front();
+      busy_ = true;
+    }
+    changed_.notify_all();
+    if (job.is_checkpoint)
+      WriteCheckpoint(job);
+    else
+      WriteModelFile(job.path, job.models[0].data());
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      busy_ = false;
+    }
+    changed_.notify_all();
+  }
+}
+
+// Append to <changed> the entries of <now> that are not in <before> with
+// the same weight, and to <removed> the features of <before> missing from
+// <now>; both are sorted by feature.
+static void Diff(const FlatWeights &before, const FlatWeights &now,
+                 FlatWeights &changed, std::vector<uint64_t> &removed)
+{
+  auto b = before.begin();
+  for (const auto &entry : now)
+  {
+    for (; b != before.end() && b->first < entry.first; ++b)
+      removed.push_back(b->first);
+    if (b != before.end() && b->first == entry.first)
+    {
+      if (std::memcmp(&b->second, &entry.second, sizeof(float)) != 0)
+        changed.push_back(entry);
+      ++b;
+    }
+    else
+      changed.push_back(entry);
+  }
+  for (; b != before.end(); ++b)
+    removed.push_back(b->first);
+}
+
+void CheckpointWriter::WriteCheckpoint(Job &job)
+{
+  const std::string &path = job.path;
+  const TrainingState &state = job.state;
+  for (FlatModel &model : job.models)
+    for (FlatWeights &weights : model)
+      std::sort(weights.begin(), weights.end(),
+                [](const std::pair<uint64_t, float> &a,
+                   const std::pair<uint64_t, float> &b) { return a.first < b.first; });
+
+  std::vector<char> buffer;
+  // An increment only pays off while the log is smaller than a snapshot.
+  if (path == last_path_ && last_.size() == job.models.size() &&
+      log_bytes_ < snapshot_bytes_)
+  {
+    SegmentHeader header;
+    std::memcpy(header.magic, kSegmentMagic, sizeof(kSegmentMagic));
+    header.epoch = state.epoch;
+    header.reserved = 0;
+    header.seed = state.seed;
+    header.num_counters = state.counters.size();
+    header.num_models = job.models.size();
+    buffer.resize(sizeof(header));
+    Put(buffer, state.counters.data(), state.counters.size() * sizeof(int));
+    FlatWeights changed;
+    std::vector<uint64_t> removed;
+    for (size_t m = 0; m < job.models.size(); m++)
+    {
+      for (int k = 0; k < 4; k++)
+      {
+        changed.clear();
+        removed.clear();
+        Diff(last_[m][k], job.models[m][k], changed, removed);
+        PutEntries(buffer, changed);
+        const uint64_t size = removed.size();
+        Put(buffer, &size, sizeof(size));
+        Put(buffer, removed.data(), removed.size() * sizeof(uint64_t));
+      }
+    }
+    header.bytes = buffer.size() - sizeof(header);
+    std::memcpy(buffer.data(), &header, sizeof(header));
+    Put(buffer, kSegmentEnd, sizeof(kSegmentEnd));
+
+    std::ofstream log(path + ".log", std::ios::binary | std::ios::app);
+    CHECK(log.write(buffer.data(), buffer.size()).good(),
+          "Cannot write the checkpoint log " + path + ".log");
+    log.close();
+    CHECK(log.good(), "Cannot write the checkpoint log " + path + ".log");
+    log_bytes_ += buffer.size();
+  }
+  else
+  {
+    CheckpointHeader header;
+    std::memcpy(header.magic, kCheckpointMagic, sizeof(kCheckpointMagic));
+    header.strategy = state.strategy;
+    header.iterations = state.iterations;
+    header.examples = state.examples;
+    header.epoch = state.epoch;
+    header.seed = state.seed;
+    header.num_counters = state.counters.size();
+    header.num_models = job.models.size();
+    Put(buffer, &header, sizeof(header));
+    Put(buffer, state.counters.data(), state.counters.size() * sizeof(int));
+    for (const FlatModel &model : job.models)
+      for (const FlatWeights &weights : model)
+        PutEntries(buffer, weights);
+
+    // Emptying the log before the new snapshot replaces the old one means a
+    // crash in between resumes from the old snapshot alone, which is still
+    // a consistent, if older, state.
+    const std::string tmp_path = path + ".tmp";
+    std::ofstream file(tmp_path, std::ios::binary);
+    CHECK(file.write(buffer.data(), buffer.size()).good(),
+          "Cannot write the checkpoint " + path);
+    file.close();
+    CHECK(file.good(), "Cannot write the checkpoint " + path);
+    std::ofstream log(path + ".log", std::ios::binary | std::ios::trunc);
+    CHECK(log.good(), "Cannot write the checkpoint log " + path + ".log");
+    log.close();
+    CHECK(std::rename(tmp_path.c_str(), path.c_str()) == 0,
+          "Cannot rename the checkpoint to " + path);
+    snapshot_bytes_ = buffer.size();
+    log_bytes_ = 0;
+    last_path_ = path;
+  }
+  last_ = std::move(job.models);
+}
+
+} // namespace HieraParser
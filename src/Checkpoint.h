@@ -0,0 +1,88 @@
+#ifndef CHECKPOINT_H_
+#define CHECKPOINT_H_
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "BaseModel.h"
+
+namespace HieraParser
+{
+
+// Trainer state after a completed epoch. <counters> holds the trainer's
+// update counters and per-worker flags; its layout is up to each trainer.
+struct TrainingState
+{
+  int strategy;
+  int iterations;
+  int examples;
+  int epoch;
+  uint64_t seed;
+  std::vector<int> counters;
+};
+
+// The weights and then the averaged weights of both labels of a model.
+typedef std::vector<FlatWeights> FlatModel;
+FlatModel FlattenModel(const Model &model);
+
+// A checkpoint is a full snapshot of the state in <path> plus a log of
+// increments in <path>.log, each holding the new training state and only
+// the weights that changed since the previous checkpoint. Read the snapshot
+// into <state> and <models>, which must be as many as were written, and
+// apply every complete increment of the log; a torn one at its end is
+// ignored. Returns false if <path> does not exist.
+bool ReadCheckpoint(const std::string &path, TrainingState &state,
+                    const std::vector<Model *> &models);
+
+// Writes checkpoints and model files on a background thread, so that the
+// training loop only pays for flattening the weights. The first checkpoint
+// of a path is a full snapshot; the following ones are appended to its log
+// as increments, until the log grows larger than the snapshot and the next
+// checkpoint compacts both into a new snapshot.
+class CheckpointWriter
+{
+public:
+  CheckpointWriter();
+  // Finishes all queued writes.
+  ~CheckpointWriter();
+
+  void SaveCheckpoint(const std::string &path, const TrainingState &state,
+                      std::vector<FlatModel> &&models);
+  // Write a model file (see WriteModelFile) from flat averaged weights.
+  void SaveModel(const std::string &path, std::vector<FlatWeights> &&cached_weights);
+  // Wait until every queued write is done.
+  void Flush();
+
+private:
+  struct Job
+  {
+    std::string path;
+    bool is_checkpoint;
+    TrainingState state;
+    std::vector<FlatModel> models;
+  };
+  void Run();
+  void WriteCheckpoint(Job &job);
+
+  CheckpointWriter(const CheckpointWriter &);
+  CheckpointWriter &operator=(const CheckpointWriter &);
+
+  std::mutex mutex_;
+  std::condition_variable changed_;
+  std::deque<Job> jobs_;
+  bool busy_;
+  bool stop_;
+  // The last checkpoint written, with entries sorted by feature, and the
+  // sizes of its snapshot and log; only used by the writer thread.
+  std::string last_path_;
+  std::vector<FlatModel> last_;
+  size_t snapshot_bytes_;
+  size_t log_bytes_;
+  std::thread thread_;
+};
+
+} // namespace HieraParser
+#endif // CHECKPOINT_H_
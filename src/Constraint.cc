@@ -1,142 +1,231 @@
 #include "Constraint.h"
+#include <memory>
 namespace HieraParser
 {
 
-inline bool LessOrEqualAlignment(const std::set<int> &lhs,
-                                 const std::set<int> &rhs)
+// lhs <= rhs iff every target position aligned only to lhs precedes all of
+// rhs, and every target position aligned only to rhs follows all of lhs.
+// Both ranges are sorted and unique; disjoint spans are decided in O(1),
+// overlapping ones with a single merge.
+inline bool LessOrEqualAlignment(const int *lhs_bgn, const int *lhs_end,
+                                 const int *rhs_bgn, const int *rhs_end)
 {
-    for (auto &x : lhs)
-        if (rhs.find(x) == rhs.end())
-            for (auto &y : rhs)
-                if (x > y)
-                    return false;
-    for (auto &y : rhs)
-        if (lhs.find(y) == lhs.end())
-            for (auto &x : lhs)
-                if (x > y)
-                    return false;
-    return true;
+    const int lhs_min = *lhs_bgn;
+    const int lhs_max = *(lhs_end - 1);
+    const int rhs_min = *rhs_bgn;
+    const int rhs_max = *(rhs_end - 1);
+    if (lhs_max < rhs_min)
+        return true;
+    if (rhs_max < lhs_min)
+        return false;
+    bool lhs_only = false;
+    bool rhs_only = false;
+    int lhs_only_max = 0;
+    int rhs_only_min = 0;
+    while (lhs_bgn != lhs_end && rhs_bgn != rhs_end)
+    {
+        if (*lhs_bgn < *rhs_bgn)
+        {
+            lhs_only = true;
+            lhs_only_max = *lhs_bgn++;
+        }
+        else if (*rhs_bgn < *lhs_bgn)
+        {
+            if (!rhs_only)
+                rhs_only_min = *rhs_bgn;
+            rhs_only = true;
+            ++rhs_bgn;
+        }
+        else
+        {
+            ++lhs_bgn;
+            ++rhs_bgn;
+        }
+    }
+    if (lhs_bgn != lhs_end)
+    {
+        lhs_only = true;
+        lhs_only_max = lhs_max;
+    }
+    if (rhs_bgn != rhs_end && !rhs_only)
+    {
+        rhs_only = true;
+        rhs_only_min = *rhs_bgn;
+    }
+    return (!lhs_only || lhs_only_max < rhs_min) &&
+           (!rhs_only || rhs_only_min > lhs_max);
 }
 
-Constraint *Constraint::CreateFromString(const std::string &line)
+// An ordered group of source words with identical alignments.
+struct AlignmentGroup
+{
+    int min;    // smallest aligned target position
+    int max;    // largest aligned target position
+    int source; // first source word of the group
+    int id;     // index into the group of every source word
+};
+
+// Source words are inserted into a list of groups kept in increasing
+// alignment order. Adjacent groups satisfy lhs <= rhs, which makes both
+// group.min and group.max non-decreasing along the list: every group whose
+// max is below the new word's min compares strictly smaller and can be
+// skipped by binary search, and the first group whose min is above its max
+// is where it goes. Only the overlapping groups in between are compared
+// explicitly, in list order, which keeps the accept/reject decision of the
+// original linear scan.
+Constraint *Constraint::CreateFromString(const StringPiece &line)
 {
-    Alignment *ret = Alignment::CreateFromString(line);
+    std::unique_ptr<Alignment> ret(Alignment::CreateFromString(line));
     if (ret == nullptr)
         return nullptr;
     const Alignment &alignment = *ret;
-    Constraint *constraint = new Constraint(alignment.size());
+    std::unique_ptr<Constraint> constraint(new Constraint(alignment.size()));
 
-    std::vector<std::vector<int>> sorted_indices;
+    std::vector<AlignmentGroup> groups;
+    std::vector<int> group_of(alignment.size(), -1);
+    int num_groups = 0;
     for (size_t i = 0; i < alignment.size(); i++)
     {
-        if (alignment[i].empty())
+        if (alignment.empty(i))
             continue;
+        const int min = alignment.Min(i);
+        const int max = alignment.Max(i);
+        auto it = std::lower_bound(
+            groups.begin(), groups.end(), min,
+            [](const AlignmentGroup &g, int v) { return g.max < v; });
         bool eq = false;
-        size_t j;
-        for (j = 0; j < sorted_indices.size(); j++)
+        for (; it != groups.end(); ++it)
         {
+            if (it->min > max)
+                break;
+            const int s = it->source;
             const bool le = LessOrEqualAlignment(
-                alignment[i], alignment[sorted_indices[j].front()]);
+                alignment.begin(i), alignment.end(i), alignment.begin(s), alignment.end(s));
             const bool ge = LessOrEqualAlignment(
-                alignment[sorted_indices[j].front()], alignment[i]);
+                alignment.begin(s), alignment.end(s), alignment.begin(i), alignment.end(i));
             if (!le && !ge)
                 return nullptr;
             eq = (le && ge);
             if (le)
                 break;
         }
-        if (!eq)
+        if (eq)
         {
-            sorted_indices.insert(sorted_indices.begin() + j, std::vector<int>());
+            group_of[i] = it->id;
         }
-        sorted_indices[j].push_back(i);
-    }
-    for (size_t i = 0; i < sorted_indices.size(); i++)
-    {
-        for (auto j : sorted_indices[i])
+        else
         {
-            (*constraint)[j] = i;
+            group_of[i] = num_groups;
+            groups.insert(it, AlignmentGroup{min, max, static_cast<int>(i), num_groups++});
         }
     }
+    std::vector<int> rank(num_groups);
+    for (size_t k = 0; k < groups.size(); k++)
+        rank[groups[k].id] = k;
+    for (size_t i = 0; i < alignment.size(); i++)
+    {
+        if (group_of[i] >= 0)
+            (*constraint)[i] = rank[group_of[i]];
+    }
     // Push the number of target-side tokens at the end of the vector.
-    constraint->push_back(sorted_indices.size());
+    constraint->push_back(groups.size());
     if (constraint->CheckBTGParsable())
-        return constraint;
+        return constraint.release();
     return nullptr;
 }
 
+// A span is BTG-parsable iff it can be split into two parsable halves whose
+// positions satisfy max(left) <= min(right) or max(right) <= min(left).
+// Since any contiguous part of a parsable span is itself parsable, the
+// split that is found first does not change the answer. Splits are searched
+// from both ends of a span at once with O(1) range min/max queries on a
+// sparse table, so each span costs O(min(|left|, |right|)) and the whole
+// check O(n log n). Scratch buffers are per thread and reused across calls.
 bool Constraint::CheckBTGParsable()
 {
     if (this->empty())
         return false;
-    std::vector<int> lmin(this->size() - 1);
-    std::vector<int> lmax(this->size() - 1);
-    std::vector<int> rmin(this->size() - 1);
-    std::vector<int> rmax(this->size() - 1);
-    std::vector<std::pair<int, int>> stack;
+    static thread_local std::vector<int> mins;
+    static thread_local std::vector<int> maxs;
+    static thread_local std::vector<std::pair<int, int>> stack;
 
-    std::vector<int> positions;
+    int n = 0;
     for (size_t i = 0; i < this->size() - 1; i++)
     {
         if ((*this)[i] >= 0)
-            positions.push_back((*this)[i]);
+            n++;
+    }
+    // A single aligned word has no split.
+    if (n < 2)
+        return false;
+    const int levels = 32 - __builtin_clz(static_cast<unsigned>(n));
+    if (mins.size() < static_cast<size_t>(n * levels))
+    {
+        mins.resize(n * levels);
+        maxs.resize(n * levels);
     }
+    int *mn = mins.data();
+    int *mx = maxs.data();
+    for (size_t i = 0, j = 0; i < this->size() - 1; i++)
+    {
+        if ((*this)[i] >= 0)
+        {
+            mn[j] = mx[j] = (*this)[i];
+            j++;
+        }
+    }
+    for (int k = 1; k < levels; k++)
+    {
+        const int half = 1 << (k - 1);
+        const int *pmn = mn + (k - 1) * n;
+        const int *pmx = mx + (k - 1) * n;
+        int *cmn = mn + k * n;
+        int *cmx = mx + k * n;
+        for (int i = 0; i + (1 << k) <= n; i++)
+        {
+            cmn[i] = std::min(pmn[i], pmn[i + half]);
+            cmx[i] = std::max(pmx[i], pmx[i + half]);
+        }
+    }
+    // min and max of positions [bgn, end).
+    auto range = [mn, mx, n](int bgn, int end, int &lo, int &hi) {
+        const int k = 31 - __builtin_clz(static_cast<unsigned>(end - bgn));
+        lo = std::min(mn[k * n + bgn], mn[k * n + end - (1 << k)]);
+        hi = std::max(mx[k * n + bgn], mx[k * n + end - (1 << k)]);
+    };
+    auto splits = [&range](int bgn, int mid, int end) {
+        int lmin, lmax, rmin, rmax;
+        range(bgn, mid, lmin, lmax);
+        range(mid, end, rmin, rmax);
+        return lmax <= rmin || rmax <= lmin;
+    };
 
-    stack.push_back({0, positions.size()});
+    stack.clear();
+    stack.emplace_back(0, n);
     while (!stack.empty())
     {
         const auto span = stack.back();
         stack.pop_back();
-        for (int i = 0; i < span.second - span.first; i++)
-        {
-            const int p = positions[span.first + i];
-            if (i == 0)
-            {
-                lmin[i] = p;
-                lmax[i] = p;
-            }
-            else
-            {
-                lmin[i] = std::min(lmin[i - 1], p);
-                lmax[i] = std::max(lmax[i - 1], p);
-            }
-        }
-        for (int i = span.second - span.first - 1; i >= 0; i--)
+        int split = -1;
+        for (int l = span.first + 1, r = span.second - 1; l <= r; l++, r--)
         {
-            const int p = positions[span.first + i];
-            if (i == span.second - span.first - 1)
-            {
-                rmin[i] = p;
-                rmax[i] = p;
-            }
-            else
+            if (splits(span.first, l, span.second))
             {
-                rmin[i] = std::min(rmin[i + 1], p);
-                ;
-                rmax[i] = std::max(rmax[i + 1], p);
-                ;
+                split = l;
+                break;
             }
-        }
-        int split = -1;
-        for (int i = 1; i < span.second - span.first; i++)
-        {
-            if (lmax[i - 1] <= rmin[i] || rmax[i] <= lmin[i - 1])
+            if (splits(span.first, r, span.second))
             {
-                split = i;
+                split = r;
                 break;
             }
         }
         if (split < 0)
             return false;
-        const int third = span.first + split;
-        if (third - span.first > 1)
-        {
-            stack.push_back({span.first, third});
-        }
-        if (span.second - third > 1)
-        {
-            stack.push_back({third, span.second});
-        }
+        if (split - span.first > 1)
+            stack.emplace_back(span.first, split);
+        if (span.second - split > 1)
+            stack.emplace_back(split, span.second);
     }
     return true;
 }
@@ -13,7 +13,7 @@ class Constraint: public std::vector<int>
         Constraint(size_t size) {assign(size, -1); };
         ~Constraint(){};
 
-        static Constraint *CreateFromString(const std::string &line);
+        static Constraint *CreateFromString(const StringPiece &line);
         bool CheckBTGParsable();
         // void push_back(int val)
         // {
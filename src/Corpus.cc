@@ -0,0 +1,276 @@
+#include "Corpus.h"
+#include "utils/MMapFile.h"
+#include "utils/ThreadPool.h"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+namespace HieraParser
+{
+
+typedef std::vector<std::pair<size_t, size_t>> Chunks;
+
+// Cut <file> into line-aligned chunks; more chunks than threads, so that a
+// chunk of long lines does not leave the other workers idle.
+static Chunks SplitChunks(const MMapFile &file, int threads)
+{
+    return LineAlignedChunks(file.data(), file.size(), std::max(threads, 1) * 8);
+}
+
+// Run f(c, data, size) for every chunk c of <file> on <threads> threads.
+template <class F>
+static void ParallelForChunks(const MMapFile &file, const Chunks &chunks,
+                              int threads, F f)
+{
+    ThreadPool pool(std::max(threads, 1));
+    std::vector<std::future<void>> results;
+    for (size_t c = 0; c < chunks.size(); c++)
+    {
+        results.emplace_back(pool.enqueue([&file, &chunks, &f, c]() {
+            f(c, file.data() + chunks[c].first,
+              chunks[c].second - chunks[c].first);
+        }));
+    }
+    for (auto &&result : results)
+        result.get();
+}
+
+void LoadInput(Corpus &corpus, const std::string &path,
+               const size_t kMaxFactorSize, int threads)
+{
+    std::cerr << "Loading input file " << path << std::endl;
+    MMapFile file(path);
+    const Chunks chunks = SplitChunks(file, threads);
+    // First pass: count the tokens of every line, so that the arena can be
+    // allocated once and every chunk knows where its sentences start.
+    std::vector<std::vector<uint32_t>> lengths(chunks.size());
+    ParallelForChunks(file, chunks, threads, [&lengths](size_t c, const char *data, size_t size) {
+        ForEachLine(data, size, [&lengths, c](const StringPiece &line) {
+            lengths[c].push_back(static_cast<uint32_t>(Sentence::CountTokens(line)));
+        });
+    });
+    std::vector<size_t> offsets(lengths.size() + 1, 0);
+    size_t num_sentences = 0;
+    for (size_t c = 0; c < lengths.size(); c++)
+    {
+        size_t tokens = 0;
+        for (const uint32_t n : lengths[c])
+            tokens += n;
+        offsets[c + 1] = offsets[c] + tokens * kMaxFactorSize;
+        num_sentences += lengths[c].size();
+    }
+    corpus.factors = kMaxFactorSize;
+    corpus.fingerprints.assign(offsets.back(), 0);
+    corpus.sentences.clear();
+    corpus.sentences.reserve(num_sentences);
+    const uint64_t *base = corpus.fingerprints.data();
+    for (size_t c = 0; c < lengths.size(); c++)
+    {
+        size_t offset = offsets[c];
+        for (const uint32_t n : lengths[c])
+        {
+            corpus.sentences.emplace_back(base + offset, n, kMaxFactorSize);
+            offset += n * kMaxFactorSize;
+        }
+    }
+    // Second pass: hash the tokens in place into the arena.
+    uint64_t *arena = corpus.fingerprints.data();
+    ParallelForChunks(file, chunks, threads, [&](size_t c, const char *data, size_t size) {
+        uint64_t *out = arena + offsets[c];
+        size_t l = 0;
+        ForEachLine(data, size, [&](const StringPiece &line) {
+            Sentence::HashFromString(line, kMaxFactorSize, out);
+            out += lengths[c][l++] * kMaxFactorSize;
+        });
+    });
+}
+
+void LoadConstraint(std::vector<TrainingExample> &training_examples,
+                    const Corpus &corpus, const std::string &path, int threads)
+{
+    MMapFile file(path);
+    const Chunks chunks = SplitChunks(file, threads);
+    std::vector<std::vector<Constraint *>> parts(chunks.size());
+    ParallelForChunks(file, chunks, threads, [&parts](size_t c, const char *data, size_t size) {
+        ForEachLine(data, size, [&parts, c](const StringPiece &line) {
+            parts[c].push_back(Constraint::CreateFromString(line));
+        });
+    });
+    size_t i = 0;
+    for (const auto &part : parts)
+    {
+        for (Constraint *constraint : part)
+        {
+            if (i < corpus.size() && constraint != nullptr)
+                training_examples.emplace_back(&corpus[i], constraint);
+            else
+                delete constraint;
+            i++;
+        }
+    }
+    std::cerr << "# Number of training examples: " << training_examples.size()
+              << std::endl;
+}
+
+static const char kCacheMagic[8] = {'H', 'P', 'C', 'A', 'C', 'H', 'E', '1'};
+
+struct CacheHeader
+{
+    char magic[8];
+    uint64_t input_checksum;
+    uint64_t align_checksum;
+    uint64_t factors;
+    uint64_t num_sentences;
+    uint64_t num_fingerprints;
+    uint64_t num_examples;
+    uint64_t num_constraint_values;
+};
+
+// The cache file is laid out as
+//   CacheHeader
+//   uint32_t sentence_length[num_sentences]     (padded to 8 bytes)
+//   uint64_t fingerprints[num_fingerprints]
+//   uint64_t example_sentence[num_examples]
+//   uint64_t constraint_end[num_examples]
+//   int32_t  constraint_values[num_constraint_values]
+static size_t Align8(size_t n) { return (n + 7) & ~static_cast<size_t>(7); }
+
+static uint64_t FileChecksum(const std::string &path)
+{
+    MMapFile file(path);
+    return Hash64(file.data(), file.size());
+}
+
+bool LoadTrainingCache(Corpus &corpus,
+                       std::vector<TrainingExample> &training_examples,
+                       const std::string &cache_path,
+                       const std::string &input_path,
+                       const std::string &align_path,
+                       const size_t kMaxFactorSize)
+{
+    if (!std::ifstream(cache_path).good())
+        return false;
+    std::unique_ptr<MMapFile> file(new MMapFile(cache_path));
+    CacheHeader header;
+    if (file->size() < sizeof(header))
+        return false;
+    std::memcpy(&header, file->data(), sizeof(header));
+    if (std::memcmp(header.magic, kCacheMagic, sizeof(kCacheMagic)) != 0 ||
+        header.factors != kMaxFactorSize ||
+        header.input_checksum != FileChecksum(input_path) ||
+        header.align_checksum != FileChecksum(align_path))
+    {
+        std::cerr << "Training cache " << cache_path
+                  << " does not match the input files, rebuilding it." << std::endl;
+        return false;
+    }
+    const size_t lengths_offset = sizeof(header);
+    const size_t fp_offset =
+        lengths_offset + Align8(header.num_sentences * sizeof(uint32_t));
+    const size_t examples_offset =
+        fp_offset + header.num_fingerprints * sizeof(uint64_t);
+    const size_t ends_offset =
+        examples_offset + header.num_examples * sizeof(uint64_t);
+    const size_t values_offset =
+        ends_offset + header.num_examples * sizeof(uint64_t);
+    CHECK(values_offset + header.num_constraint_values * sizeof(int32_t) <= file->size(),
+          "Training cache " + cache_path + " is truncated.");
+
+    std::cerr << "Loading training cache " << cache_path << std::endl;
+    const char *data = file->data();
+    const uint32_t *lengths = reinterpret_cast<const uint32_t *>(data + lengths_offset);
+    const uint64_t *fingerprints = reinterpret_cast<const uint64_t *>(data + fp_offset);
+    const uint64_t *sentence_ids = reinterpret_cast<const uint64_t *>(data + examples_offset);
+    const uint64_t *ends = reinterpret_cast<const uint64_t *>(data + ends_offset);
+    const int32_t *values = reinterpret_cast<const int32_t *>(data + values_offset);
+
+    corpus.factors = kMaxFactorSize;
+    corpus.fingerprints.clear();
+    corpus.sentences.clear();
+    corpus.sentences.reserve(header.num_sentences);
+    size_t offset = 0;
+    for (size_t i = 0; i < header.num_sentences; i++)
+    {
+        corpus.sentences.emplace_back(fingerprints + offset, lengths[i], kMaxFactorSize);
+        offset += lengths[i] * kMaxFactorSize;
+    }
+    CHECK(offset == header.num_fingerprints, "Training cache " + cache_path + " is corrupted.");
+    corpus.mapping = std::move(file);
+
+    training_examples.reserve(training_examples.size() + header.num_examples);
+    uint64_t bgn = 0;
+    for (size_t i = 0; i < header.num_examples; i++)
+    {
+        CHECK(sentence_ids[i] < header.num_sentences && bgn <= ends[i],
+              "Training cache " + cache_path + " is corrupted.");
+        Constraint *constraint = new Constraint();
+        constraint->assign(values + bgn, values + ends[i]);
+        training_examples.emplace_back(&corpus[sentence_ids[i]], constraint);
+        bgn = ends[i];
+    }
+    std::cerr << "# Number of training examples: " << training_examples.size()
+              << std::endl;
+    return true;
+}
+
+void WriteTrainingCache(const Corpus &corpus,
+                        const std::vector<TrainingExample> &training_examples,
+                        const std::string &cache_path,
+                        const std::string &input_path,
+                        const std::string &align_path)
+{
+    std::cerr << "Writing training cache " << cache_path << std::endl;
+    CacheHeader header;
+    std::memcpy(header.magic, kCacheMagic, sizeof(kCacheMagic));
+    header.input_checksum = FileChecksum(input_path);
+    header.align_checksum = FileChecksum(align_path);
+    header.factors = corpus.factors;
+    header.num_sentences = corpus.size();
+    header.num_fingerprints = 0;
+    header.num_examples = training_examples.size();
+    header.num_constraint_values = 0;
+    std::vector<uint32_t> lengths(corpus.size());
+    for (size_t i = 0; i < corpus.size(); i++)
+    {
+        lengths[i] = static_cast<uint32_t>(corpus[i].size());
+        header.num_fingerprints += corpus[i].size() * corpus.factors;
+    }
+    std::vector<uint64_t> sentence_ids(training_examples.size());
+    std::vector<uint64_t> ends(training_examples.size());
+    for (size_t i = 0; i < training_examples.size(); i++)
+    {
+        sentence_ids[i] = training_examples[i].first - &corpus[0];
+        header.num_constraint_values += training_examples[i].second->size();
+        ends[i] = header.num_constraint_values;
+    }
+
+    // Write to a temporary file first, so that an interrupted run never
+    // leaves a truncated cache behind.
+    const std::string tmp_path = cache_path + ".tmp";
+    std::ofstream file(tmp_path, std::ios::binary);
+    CHECK(file.good(), "Cannot write the training cache " + cache_path);
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char *>(lengths.data()),
+               lengths.size() * sizeof(uint32_t));
+    const char padding[8] = {0};
+    file.write(padding, Align8(lengths.size() * sizeof(uint32_t)) -
+                            lengths.size() * sizeof(uint32_t));
+    // Sentences are contiguous in the arena, in corpus order.
+    if (!corpus.empty())
+        file.write(reinterpret_cast<const char *>(corpus[0][0]),
+                   header.num_fingerprints * sizeof(uint64_t));
+    file.write(reinterpret_cast<const char *>(sentence_ids.data()),
+               sentence_ids.size() * sizeof(uint64_t));
+    file.write(reinterpret_cast<const char *>(ends.data()),
+               ends.size() * sizeof(uint64_t));
+    for (const TrainingExample &example : training_examples)
+        file.write(reinterpret_cast<const char *>(example.second->data()),
+                   example.second->size() * sizeof(int32_t));
+    file.close();
+    CHECK(file.good(), "Cannot write the training cache " + cache_path);
+    CHECK(std::rename(tmp_path.c_str(), cache_path.c_str()) == 0,
+          "Cannot write the training cache " + cache_path);
+}
+
+} // namespace HieraParser
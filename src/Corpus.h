@@ -0,0 +1,71 @@
+#ifndef CORPUS_H_
+#define CORPUS_H_
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include "Constraint.h"
+#include "Sentence.h"
+#include "utils/MMapFile.h"
+
+namespace HieraParser
+{
+
+typedef std::pair<const Sentence *, Constraint *> TrainingExample;
+
+// Corpus-wide arena: the fingerprints of all tokens are kept in one
+// contiguous buffer and every Sentence is a view into it.  The buffer is
+// either <fingerprints> or, for a corpus read from a training cache, the
+// memory-mapped cache file held by <mapping>.
+class Corpus
+{
+public:
+  Corpus() : factors(0){};
+  ~Corpus(){};
+
+  size_t size() const { return sentences.size(); }
+  bool empty() const { return sentences.empty(); }
+  const Sentence &operator[](size_t i) const { return sentences[i]; }
+
+  std::vector<Sentence> sentences;
+  std::vector<uint64_t> fingerprints;
+  std::unique_ptr<MMapFile> mapping;
+  size_t factors;
+
+private:
+  // sentences point into <fingerprints>, so a corpus must not be copied.
+  Corpus(const Corpus &);
+  Corpus &operator=(const Corpus &);
+};
+
+// Load the annotated input (one sentence per line, factors separated by tabs).
+// The file is memory-mapped, cut into line-aligned chunks and tokenized on
+// <threads> threads; the sentences keep the order of the file.
+void LoadInput(Corpus &corpus, const std::string &path,
+               const size_t kMaxFactorSize, int threads = 1);
+
+// Load the alignment file in the same way and pair every BTG-parsable
+// constraint with the sentence on the same line.
+void LoadConstraint(std::vector<TrainingExample> &training_examples,
+                    const Corpus &corpus, const std::string &path,
+                    int threads = 1);
+
+// Binary training cache: the hashed corpus and the filtered, BTG-parsable
+// constraints, stamped with checksums of the input and alignment files.
+// LoadTrainingCache() memory-maps the cache and returns false if it does not
+// exist or does not match the current files, in which case the caller should
+// load the text files and call WriteTrainingCache().
+bool LoadTrainingCache(Corpus &corpus,
+                       std::vector<TrainingExample> &training_examples,
+                       const std::string &cache_path,
+                       const std::string &input_path,
+                       const std::string &align_path,
+                       const size_t kMaxFactorSize);
+void WriteTrainingCache(const Corpus &corpus,
+                        const std::vector<TrainingExample> &training_examples,
+                        const std::string &cache_path,
+                        const std::string &input_path,
+                        const std::string &align_path);
+
+} // namespace HieraParser
+#endif // CORPUS_H_
@@ -0,0 +1,115 @@
+#include "FeatureCache.h"
+#include <cstring>
+#include <sstream>
+#include <tuple>
+
+namespace HieraParser
+{
+
+// Rough size of a hash-map node holding an Entry.
+static const size_t kIndexEntryBytes = 48;
+
+ExampleFeatures::~ExampleFeatures()
+{
+  owner_->bytes_.fetch_sub(bytes(), std::memory_order_relaxed);
+}
+
+size_t ExampleFeatures::bytes() const
+{
+  return (arena_.capacity() + keys_.capacity()) * sizeof(uint64_t) +
+         index_.size() * kIndexEntryBytes;
+}
+
+bool ExampleFeatures::Find(uint64_t key, std::vector<uint64_t> &features)
+{
+  const auto it = index_.find(key);
+  if (it == index_.end())
+  {
+    owner_->misses_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  Entry &entry = it->second;
+  entry.used = true;
+  features.assign(arena_.begin() + entry.offset,
+                  arena_.begin() + entry.offset + entry.size);
+  owner_->hits_.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+void ExampleFeatures::Insert(uint64_t key, const std::vector<uint64_t> &features)
+{
+  const size_t before = bytes();
+  const size_t added = features.size() * sizeof(uint64_t) + kIndexEntryBytes;
+  if (owner_->bytes_.load(std::memory_order_relaxed) + added > owner_->budget_)
+  {
+    owner_->rejected_.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  const Entry entry{static_cast<uint32_t>(arena_.size()),
+                    static_cast<uint32_t>(features.size()), true};
+  if (!index_.emplace(key, entry).second)
+    return;
+  arena_.insert(arena_.end(), features.begin(), features.end());
+  keys_.push_back(key);
+  owner_->bytes_.fetch_add(bytes() - before, std::memory_order_relaxed);
+}
+
+void ExampleFeatures::Sweep()
+{
+  // The kept vectors move down over the evicted ones in arena order, so
+  // the storage is reused and nothing is allocated.
+  const size_t before = bytes();
+  size_t arena_size = 0;
+  size_t num_keys = 0;
+  for (const uint64_t key : keys_)
+  {
+    const auto it = index_.find(key);
+    Entry &entry = it->second;
+    if (!entry.used)
+    {
+      index_.erase(it);
+      owner_->evicted_.fetch_add(1, std::memory_order_relaxed);
+      continue;
+    }
+    if (entry.offset != arena_size)
+      std::memmove(arena_.data() + arena_size, arena_.data() + entry.offset,
+                   entry.size * sizeof(uint64_t));
+    entry.offset = static_cast<uint32_t>(arena_size);
+    entry.used = false;
+    arena_size += entry.size;
+    keys_[num_keys++] = key;
+  }
+  arena_.resize(arena_size);
+  keys_.resize(num_keys);
+  const size_t after = bytes();
+  if (after < before)
+    owner_->bytes_.fetch_sub(before - after, std::memory_order_relaxed);
+  else
+    owner_->bytes_.fetch_add(after - before, std::memory_order_relaxed);
+}
+
+ExampleFeatures *FeatureCache::Get(const Sentence *sentence)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = examples_.find(sentence);
+  if (it == examples_.end())
+    it = examples_.emplace(std::piecewise_construct, std::forward_as_tuple(sentence),
+                           std::forward_as_tuple(this)).first;
+  return &it->second;
+}
+
+std::string FeatureCache::Stats()
+{
+  const uint64_t hits = hits_.exchange(0);
+  const uint64_t misses = misses_.exchange(0);
+  const uint64_t rejected = rejected_.exchange(0);
+  const uint64_t evicted = evicted_.exchange(0);
+  std::stringstream stats;
+  stats << "Feature cache: " << bytes_.load() / (1 << 20) << " of "
+        << budget_ / (1 << 20) << " MB, hit rate "
+        << (hits + misses > 0 ? 100.0 * hits / (hits + misses) : 0.0)
+        << "%, " << rejected << " not kept, " << evicted << " evicted.";
+  return stats.str();
+}
+
+} // namespace HieraParser
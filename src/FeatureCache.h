@@ -0,0 +1,78 @@
+#ifndef FEATURE_CACHE_H_
+#define FEATURE_CACHE_H_
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "Sentence.h"
+
+namespace HieraParser
+{
+
+class FeatureCache;
+
+// The feature vectors of the candidate splits of one training example. A
+// vector only depends on the sentence, the span, the pivot and the parent
+// node, so it stays valid across epochs. Only the thread that trains on
+// the example may use it.
+class ExampleFeatures
+{
+public:
+  ExampleFeatures(FeatureCache *owner) : owner_(owner){};
+  ~ExampleFeatures();
+
+  // Copy the vector of <key> into <features>; false on a miss.
+  bool Find(uint64_t key, std::vector<uint64_t> &features);
+  // Keep <features> under <key>, unless the cache is over its budget.
+  void Insert(uint64_t key, const std::vector<uint64_t> &features);
+  // Evict the vectors that were not used since the previous call, i.e. in
+  // the latest visit of the example; the beam rarely comes back to them.
+  void Sweep();
+
+private:
+  struct Entry
+  {
+    uint32_t offset;
+    uint32_t size;
+    bool used;
+  };
+  size_t bytes() const;
+
+  FeatureCache *owner_;
+  std::unordered_map<uint64_t, Entry> index_;
+  // The vectors back to back, and their keys in the same order.
+  std::vector<uint64_t> arena_;
+  std::vector<uint64_t> keys_;
+};
+
+// Per-example feature vectors for training, kept across epochs within a
+// memory budget. Once the budget is used up new vectors are not kept, so
+// that examples already cached are not evicted by ones that would be
+// evicted in turn before their next visit.
+class FeatureCache
+{
+public:
+  FeatureCache(size_t budget) : budget_(budget), bytes_(0), hits_(0),
+                                misses_(0), rejected_(0), evicted_(0){};
+
+  // The vectors of the example of <sentence>; safe to call from any thread.
+  ExampleFeatures *Get(const Sentence *sentence);
+  // Memory use, hit rate and evictions since the previous call.
+  std::string Stats();
+
+private:
+  friend class ExampleFeatures;
+  const size_t budget_;
+  std::mutex mutex_;
+  std::unordered_map<const Sentence *, ExampleFeatures> examples_;
+  std::atomic<size_t> bytes_;
+  std::atomic<uint64_t> hits_;
+  std::atomic<uint64_t> misses_;
+  std::atomic<uint64_t> rejected_;
+  std::atomic<uint64_t> evicted_;
+};
+
+} // namespace HieraParser
+#endif // FEATURE_CACHE_H_
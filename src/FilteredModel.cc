@@ -0,0 +1,50 @@
+#include "FilteredModel.h"
+#include <iostream>
+
+namespace HieraParser
+{
+
+void FilteredModel::ReadModel(const std::string &path)
+{
+    Model::ReadModel(path);
+    BloomFilter *filter = new BloomFilter(weights.size(), bits_per_key_);
+    for (size_t s = 0; s < Weights::kShards; s++)
+        for (const auto &entry : weights.shard(s))
+            filter->Add(entry.first);
+    std::cerr << "Feature filter: " << filter->bytes() / 1024 << " KB for "
+              << weights.size() << " features." << std::endl;
+    filter_.reset(filter);
+}
+
+// The dense features are not in the filter; they are always found.
+float FilteredModel::Score(const std::vector<uint64_t> &features, int label) const
+{
+    float score = 0.0;
+    for (const uint64_t feature : features)
+    {
+        if (feature >= kDenseFeatures && !filter_->MayContain(feature))
+            continue;
+        const WeightEntry *entry = weights.Find(feature);
+        if (entry != nullptr)
+            score += (*entry)[label];
+    }
+    return score;
+}
+
+void FilteredModel::Scores(const std::vector<uint64_t> &features, float *scores) const
+{
+    scores[0] = scores[1] = 0.0;
+    for (const uint64_t feature : features)
+    {
+        if (feature >= kDenseFeatures && !filter_->MayContain(feature))
+            continue;
+        const WeightEntry *entry = weights.Find(feature);
+        if (entry != nullptr)
+        {
+            scores[0] += (*entry)[0];
+            scores[1] += (*entry)[1];
+        }
+    }
+}
+
+} // namespace HieraParser
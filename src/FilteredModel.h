@@ -0,0 +1,33 @@
+#ifndef FILTERED_MODEL_H_
+#define FILTERED_MODEL_H_
+#include "BaseModel.h"
+#include "utils/BloomFilter.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace HieraParser
+{
+
+// A model for parsing with a Bloom filter of the features in its maps in
+// front of them, so that most features missing from the model never probe
+// the maps. The filter is built when the model is read, with <bits_per_key>
+// bits per feature; the weights must not change afterwards.
+class FilteredModel : public Model
+{
+public:
+  FilteredModel(const Config &cfg, int bits_per_key)
+      : Model(cfg), bits_per_key_(bits_per_key){};
+  virtual ~FilteredModel(){};
+
+  void ReadModel(const std::string &path);
+  float Score(const std::vector<uint64_t> &features, int label) const;
+  void Scores(const std::vector<uint64_t> &features, float *scores) const;
+
+private:
+  const int bits_per_key_;
+  std::unique_ptr<const BloomFilter> filter_;
+};
+
+} // namespace HieraParser
+#endif // FILTERED_MODEL_H_
@@ -0,0 +1,149 @@
+#include "HashedModel.h"
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+
+namespace HieraParser
+{
+
+// First 8 bytes of a hashed model file; a model file of whole fingerprints
+// starts with a number of entries instead, which is never this large.
+static const uint64_t kHashedMagic = 0x3148534148504948ULL; // "HIPHASH1"
+
+struct HashedHeader
+{
+    uint64_t magic;
+    uint64_t bits;
+};
+
+// The arrays go to and from files as floats.
+static_assert(sizeof(std::atomic<float>) == sizeof(float),
+              "std::atomic<float> must have the layout of float");
+
+// Add <value> to <target>, which other threads may add to at the same time
+// if <shared>.
+static void Add(std::atomic<float> &target, float value, bool shared)
+{
+    float old = target.load(std::memory_order_relaxed);
+    if (!shared)
+    {
+        target.store(old + value, std::memory_order_relaxed);
+        return;
+    }
+    while (!target.compare_exchange_weak(old, old + value,
+                                         std::memory_order_relaxed))
+    {
+    }
+}
+
+HashedModel::HashedModel(int bits) : shared_(false)
+{
+    Resize(bits);
+}
+
+void HashedModel::Resize(int bits)
+{
+    CHECK(bits > 0 && bits <= 32, "-hash_bits must be between 1 and 32.");
+    bits_ = bits;
+    mask_ = (uint64_t(1) << bits) - 1;
+    weights_ = std::vector<std::atomic<float>>(2 * (mask_ + 1));
+    averaged_.clear();
+}
+
+void HashedModel::SetShared(bool shared)
+{
+    // The averaged weights must exist before the threads update them.
+    if (shared && averaged_.empty())
+        averaged_ = std::vector<std::atomic<float>>(weights_.size());
+    shared_ = shared;
+}
+
+bool IsHashedModelFile(const std::string &path)
+{
+    std::ifstream file(path, std::ios::binary);
+    uint64_t magic = 0;
+    return file.read(reinterpret_cast<char *>(&magic), sizeof(magic)).good() &&
+           magic == kHashedMagic;
+}
+
+void HashedModel::WriteModel(const std::string &path, bool) const
+{
+    const std::vector<std::atomic<float>> &weights =
+        averaged_.empty() ? weights_ : averaged_;
+    const HashedHeader header{kHashedMagic, static_cast<uint64_t>(bits_)};
+    std::ofstream file(path, std::ios::binary);
+    CHECK(file.write(reinterpret_cast<const char *>(&header), sizeof(header)).good() &&
+              file.write(reinterpret_cast<const char *>(weights.data()),
+                         weights.size() * sizeof(float)).good(),
+          "Cannot write the model data");
+    file.close();
+}
+
+void HashedModel::ReadModel(const std::string &path)
+{
+    if (!IsHashedModelFile(path))
+    {
+        Model::ReadModel(path);
+        Resize(bits_);
+        weights.ForEach([this](uint64_t feature, const WeightEntry &entry) {
+            for (int i = 0; i < 2; i++)
+                Add(weights_[Slot(feature) + i], entry[i], false);
+        });
+        weights.clear();
+        return;
+    }
+    std::cerr << "Loading hashed model from " << path << std::endl;
+    std::ifstream file(path, std::ios::binary);
+    HashedHeader header;
+    CHECK(file.read(reinterpret_cast<char *>(&header), sizeof(header)).good(),
+          "Error, model fromat is incorrect.");
+    Resize(static_cast<int>(header.bits));
+    CHECK(file.read(reinterpret_cast<char *>(weights_.data()),
+                    weights_.size() * sizeof(float)).good(),
+          "Cannot read the model data");
+    std::cerr << (mask_ + 1) << " slots of 2^" << bits_ << " were read."
+              << std::endl;
+}
+
+float HashedModel::Score(const std::vector<uint64_t> &features, int label) const
+{
+    float score = 0.0;
+    for (const uint64_t feature : features)
+        score += weights_[Slot(feature) + label].load(std::memory_order_relaxed);
+    return score;
+}
+
+void HashedModel::Scores(const std::vector<uint64_t> &features, float *scores) const
+{
+    scores[0] = scores[1] = 0.0;
+    for (const uint64_t feature : features)
+    {
+        const std::atomic<float> *slot = &weights_[Slot(feature)];
+        scores[0] += slot[0].load(std::memory_order_relaxed);
+        scores[1] += slot[1].load(std::memory_order_relaxed);
+    }
+}
+
+void HashedModel::Update(const FeaturesDiff &featuresDiff, const float &tau,
+                         const float &coefficient)
+{
+    if (averaged_.empty())
+        averaged_ = std::vector<std::atomic<float>>(weights_.size());
+    for (const DiffEntry &entry : featuresDiff)
+    {
+        const float delta = tau * entry.count;
+        const size_t i = Slot(entry.feature) + entry.label;
+        Add(weights_[i], delta, shared_);
+        Add(averaged_[i], delta * coefficient, shared_);
+    }
+}
+
+void HashedModel::CopyWeightsToAveraged()
+{
+    averaged_ = std::vector<std::atomic<float>>(weights_.size());
+    for (size_t i = 0; i < weights_.size(); i++)
+        averaged_[i].store(weights_[i].load(std::memory_order_relaxed),
+                           std::memory_order_relaxed);
+}
+
+} // namespace HieraParser
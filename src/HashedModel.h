@@ -0,0 +1,58 @@
+#ifndef HASHED_MODEL_H_
+#define HASHED_MODEL_H_
+#include "BaseModel.h"
+#include <atomic>
+#include <string>
+#include <vector>
+
+namespace HieraParser
+{
+
+// A model whose weights are a dense float[2^bits][2] array indexed by the
+// low <bits> bits of the feature fingerprints, instead of maps keyed by the
+// whole fingerprints (the hashing trick). Features that share those bits
+// share their weights. Memory is fixed, 8 bytes per slot for parsing and
+// twice that for training, and a lookup is one indexed load. The weights
+// are atomic so that the workers of Hogwild training can all update the
+// one array in place.
+class HashedModel : public Model
+{
+public:
+  explicit HashedModel(int bits);
+  virtual ~HashedModel(){};
+
+  int bits() const { return bits_; }
+  // Write the averaged weights as a hashed model file: a header, then the
+  // array itself.
+  void WriteModel(const std::string &path, bool = true) const;
+  // Read a hashed model file with one read, taking its bits, or fold the
+  // weights of a model file of whole fingerprints into the array.
+  void ReadModel(const std::string &path);
+  float Score(const std::vector<uint64_t> &features, int label) const;
+  void Scores(const std::vector<uint64_t> &features, float *scores) const;
+  void Update(const FeaturesDiff &featuresDiff, const float &tau,
+              const float &coefficient);
+  void CopyWeightsToAveraged();
+  // The array does not grow, so there is nothing to prune.
+  size_t Prune(size_t) { return 0; }
+  // While <shared>, Update may run on several threads at once.
+  void SetShared(bool shared);
+
+private:
+  size_t Slot(uint64_t feature) const { return 2 * (feature & mask_); }
+  void Resize(int bits);
+
+  int bits_;
+  uint64_t mask_;
+  bool shared_;
+  // weights_[2 * slot + label]; the averaged weights alike, allocated by
+  // the first update. Read and written as whole arrays of floats.
+  std::vector<std::atomic<float>> weights_;
+  std::vector<std::atomic<float>> averaged_;
+};
+
+// Whether <path> is a model file written by HashedModel.
+bool IsHashedModelFile(const std::string &path);
+
+} // namespace HieraParser
+#endif // HASHED_MODEL_H_
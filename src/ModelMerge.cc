@@ -0,0 +1,98 @@
+#include "ModelMerge.h"
+#include <memory>
+#include "HashedModel.h"
+#include "utils/MMapFile.h"
+
+namespace HieraParser
+{
+
+// A model file as written by Model::WriteModel: the magic, then for each
+// label the number of entries followed by the (feature, weight) entries.
+// <legacy> files have no magic (see kModelFileMagic).
+struct ModelFileView
+{
+  static const size_t kEntrySize = sizeof(size_t) + sizeof(float);
+
+  explicit ModelFileView(const std::string &path) : file(new MMapFile(path))
+  {
+    CHECK(!IsHashedModelFile(path),
+          "Error, " + path + " is a hashed model; only model files of whole "
+          "fingerprints can be merged.");
+    uint64_t magic = 0;
+    if (file->size() >= sizeof(magic))
+      std::memcpy(&magic, file->data(), sizeof(magic));
+    legacy = magic != kModelFileMagic;
+    size_t offset = legacy ? 0 : sizeof(magic);
+    for (int i = 0; i < 2; i++)
+    {
+      CHECK(offset + sizeof(size_t) <= file->size(),
+            "Error, model format is incorrect: " + path);
+      std::memcpy(&counts[i], file->data() + offset, sizeof(size_t));
+      offset += sizeof(size_t);
+      entries[i] = file->data() + offset;
+      CHECK(counts[i] <= (file->size() - offset) / kEntrySize,
+            "Error, model format is incorrect: " + path);
+      offset += counts[i] * kEntrySize;
+    }
+  }
+
+  std::unique_ptr<MMapFile> file;
+  const char *entries[2];
+  size_t counts[2];
+  bool legacy;
+};
+
+void MergeModelFiles(const std::vector<std::string> &paths,
+                     const std::vector<int> &sizes, int threads, Model &merged)
+{
+  CHECK(paths.size() == sizes.size(), "One size is needed for every model.");
+  std::vector<ModelFileView> models;
+  int normalization = 0;
+  for (size_t j = 0; j < paths.size(); j++)
+  {
+    models.emplace_back(paths[j]);
+    normalization += sizes[j];
+  }
+  std::vector<float> rates(paths.size());
+  for (size_t j = 0; j < paths.size(); j++)
+    rates[j] = float(sizes[j]) / normalization;
+
+  // Task p owns the weight shards s with s % tasks == p and scans every
+  // file, adding the models in order so that the sums match ParaMix. The
+  // files stay mapped and are only read: skipping an entry of another shard
+  // costs a hash, far less than the map insert of an owned one, and nothing
+  // but the merged weights is ever allocated.
+  merged.Clear();
+  const size_t tasks = static_cast<size_t>(std::max(1, threads));
+  ThreadPool pool(tasks);
+  std::vector<std::future<void>> results;
+  for (size_t p = 0; p < tasks; p++)
+  {
+    results.emplace_back(pool.enqueue([&models, &rates, &merged, tasks, p]() {
+      Weights &mixed = merged.weights;
+      for (int i = 0; i < 2; i++)
+      {
+        for (size_t j = 0; j < models.size(); j++)
+        {
+          const char *entry = models[j].entries[i];
+          for (size_t k = 0; k < models[j].counts[i]; k++, entry += ModelFileView::kEntrySize)
+          {
+            size_t feature;
+            float weight;
+            std::memcpy(&feature, entry, sizeof(feature));
+            if (models[j].legacy)
+              feature = ConvertLegacyFeature(feature);
+            if (Weights::ShardOf(feature) % tasks != p)
+              continue;
+            std::memcpy(&weight, entry + sizeof(feature), sizeof(weight));
+            mixed[feature][2 + i] += weight * rates[j];
+          }
+        }
+      }
+    }));
+  }
+  for (auto &&result : results)
+    result.get();
+}
+
+} // namespace HieraParser
@@ -0,0 +1,18 @@
+#ifndef MODEL_MERGE_H_
+#define MODEL_MERGE_H_
+#include <string>
+#include <vector>
+#include "BaseModel.h"
+
+namespace HieraParser
+{
+
+// Merge the averaged weights of the model files <paths> into <merged> as
+// Model::ParaMix does, weighting model j by sizes[j] / sum(sizes). The files
+// are memory-mapped and streamed rather than read into maps, and <threads>
+// tasks each build a disjoint part of the merged weights.
+void MergeModelFiles(const std::vector<std::string> &paths,
+                     const std::vector<int> &sizes, int threads, Model &merged);
+
+} // namespace HieraParser
+#endif // MODEL_MERGE_H_
@@ -5,7 +5,9 @@
 #include "BaseModel.h"
 #include "Config.h"
 #include <iterator>
+#include <memory>
 #include <string>
+#include <unordered_map>
 
 
 using namespace NAMESPACE_FOR_HASH_FUNCTIONS;
@@ -44,6 +46,47 @@ inline uint64_t FeatureFingerPrintCat(uint64_t fp1, uint64_t fp2, uint64_t fp3,
   return FeatureFingerPrintCat(FeatureFingerPrintCat(fp1, fp2, fp3, fp4), fp5);
 }
 
+// Ids of the features of the templates with small domains, which are
+// looked up in a direct-indexed array of the weights instead of being
+// hashed (see Weights).
+static const uint64_t kDenseBias = 0;
+static const uint64_t kDenseBalance = kDenseBias + 1;            // cl
+static const uint64_t kDenseTreeSize = kDenseBalance + 3;        // sn
+static const uint64_t kDenseSubtreeSizes = kDenseTreeSize + 100; // nln, nrn
+static const uint64_t kDenseNT = kDenseSubtreeSizes + 6 * 6;     // gp_nt
+static const uint64_t kDenseNTSide = kDenseNT + 3;               // gp_nt, gp_side
+static_assert(kDenseNTSide + 3 * 3 <= kDenseFeatures,
+              "Too many dense features");
+
+uint64_t ConvertLegacyFeature(uint64_t feature)
+{
+  // The dense templates used to be fingerprinted like the lexical ones,
+  // with the first six fingerprint numbers.
+  static const std::unordered_map<uint64_t, uint64_t> kLegacy = [] {
+    const std::unique_ptr<uint64_t[]> fp(FeatureFingerprintNumbers(6));
+    std::unordered_map<uint64_t, uint64_t> legacy;
+    legacy[fp[0]] = kDenseBias;
+    for (uint64_t cl = 0; cl < 3; cl++)
+      legacy[FeatureFingerPrintCat(fp[1], cl)] = kDenseBalance + cl;
+    for (uint64_t sn = 0; sn < kDenseSubtreeSizes - kDenseTreeSize; sn++)
+      legacy[FeatureFingerPrintCat(fp[2], sn)] = kDenseTreeSize + sn;
+    for (uint64_t nln = 0; nln < 6; nln++)
+      for (uint64_t nrn = 0; nrn < 6; nrn++)
+        legacy[FeatureFingerPrintCat(fp[3], nln, nrn)] =
+            kDenseSubtreeSizes + nln * 6 + nrn;
+    for (uint64_t gp_nt = 0; gp_nt < 3; gp_nt++)
+    {
+      legacy[FeatureFingerPrintCat(fp[4], gp_nt)] = kDenseNT + gp_nt;
+      for (uint64_t gp_side = 0; gp_side < 3; gp_side++)
+        legacy[FeatureFingerPrintCat(fp[5], gp_nt, gp_side)] =
+            kDenseNTSide + gp_nt * 3 + gp_side;
+    }
+    return legacy;
+  }();
+  const auto it = kLegacy.find(feature);
+  return it == kLegacy.end() ? feature : it->second;
+}
+
 inline void PreCalculateSpan(const ParserSpan &span,
                              const Constraint &constraint,
                              std::vector<int> &lmin, std::vector<int> &rmin,
@@ -85,27 +128,55 @@ Parser::Parser(const Config &cfg) {
 
 
 void Parser::Parse(const Sentence &sentence, const Constraint *constraint,
-                   std::vector<std::vector<ParserAction>> &nbestActions,
-                   std::vector<ParserAction> &oracleActions,
-                   const Model &model) const{
-  Agenda old_agenda;
-  Agenda new_agenda;
+                   std::vector<ParserState> &nbest, ParserState &oracle,
+                   const Model &model, bool max_violation,
+                   ExampleFeatures *cache) const{
+  // Reused by every sentence parsed by this thread, so that the beam stops
+  // allocating once its states have grown to the longest sentence; the
+  // vectors only grow, and the first <beam_size> states are the beam, in
+  // the order the agenda pops it, lowest score first.
+  static thread_local std::vector<ParserState> beam(1, ParserState(0));
+  static thread_local std::vector<ParserState> next;
+  static thread_local Agenda agenda;
+  static thread_local std::vector<size_t> features;
+  static thread_local std::vector<int> lmin, lmax, rmin, rmax;
+  float scores[2];
   size_t length = sentence.size();
-  old_agenda.push(ParserState(length));
-  std::vector<size_t> features;
+  size_t beam_size = 1;
+  beam[0].Reset(length);
+  oracle.Reset(length);
+  const bool track_gold = constraint != nullptr && max_violation;
+  // Max-violation: the best valid prefix of the previous transition, which
+  // may have fallen off the beam, and the best and valid prefixes of the
+  // transition with the largest score gap so far.
+  static thread_local ParserState gold(0);
+  static thread_local ParserState violation_sys(0);
+  static thread_local ParserState violation_ref(0);
+  gold.Reset(length);
+  bool has_gold = track_gold;
+  float max_gap = std::numeric_limits<float>::lowest();
+  bool has_violation = false;
   for (size_t transition = 0; transition < length - 1; transition++) {
     int num_valid = 0;
     float oracle_score = std::numeric_limits<float>::lowest();
     if (constraint != nullptr) {
-      oracleActions.clear();
+      oracle.actions.clear();
     }
-    while (!old_agenda.empty()) {
-      const ParserState &state = old_agenda.top();
+    for (size_t b = 0; b < beam_size; b++) {
+      const ParserState &state = beam[b];
+      // The last state is the best prefix of the previous transition.
+      if (has_gold && transition > 0 && b == beam_size - 1 &&
+          state.score - gold.score > max_gap && state.actions != gold.actions) {
+        max_gap = state.score - gold.score;
+        violation_sys = state;
+        violation_ref = gold;
+        has_violation = true;
+      }
       const ParserSpan &span = state.stack.back();
-      std::vector<int> lmin(span.end - span.bgn);
-      std::vector<int> lmax(span.end - span.bgn);
-      std::vector<int> rmin(span.end - span.bgn);
-      std::vector<int> rmax(span.end - span.bgn);
+      lmin.assign(span.end - span.bgn, 0);
+      lmax.assign(span.end - span.bgn, 0);
+      rmin.assign(span.end - span.bgn, 0);
+      rmax.assign(span.end - span.bgn, 0);
       if (constraint != nullptr) {
         PreCalculateSpan(span, *constraint, lmin, rmin, lmax, rmax);
       }
@@ -113,7 +184,9 @@ void Parser::Parse(const Sentence &sentence, const Constraint *constraint,
       // action is the parent action.
       for (int pivot = span.bgn + 1; pivot < span.end; pivot++) {
         bool valid = false;
-        ExtractFeatures(sentence, action, span, pivot, features);
+        CachedFeatures(sentence, action, span, pivot, cache, features);
+        // Both labels share the features, so look them up once.
+        model.Scores(features, scores);
         // Consider the tree with STR node split at <pivot>.
         if (constraint != nullptr) {
           valid =
@@ -121,8 +194,8 @@ void Parser::Parse(const Sentence &sentence, const Constraint *constraint,
                lmax[pivot - 1 - span.bgn] <= rmin[pivot - span.bgn]) &&
               state.valid;
         }
-        AddState(state, features, ParserAction(pivot, false), valid, new_agenda,
-                 oracle_score, oracleActions, num_valid, model);
+        AddState(state, b, state.score + scores[0], ParserAction(pivot, false),
+                 valid, agenda, oracle_score, oracle, num_valid);
         // Consider the tree with INV node split at <pivot>.
         if (constraint != nullptr) {
           valid =
@@ -130,53 +203,92 @@ void Parser::Parse(const Sentence &sentence, const Constraint *constraint,
                rmax[pivot - span.bgn] <= lmin[pivot - 1 - span.bgn]) &&
               state.valid;
         }
-        AddState(state, features, ParserAction(pivot, true), valid, new_agenda,
-                 oracle_score, oracleActions, num_valid, model);
+        AddState(state, b, state.score + scores[1], ParserAction(pivot, true),
+                 valid, agenda, oracle_score, oracle, num_valid);
+      }
+    }
+    if (has_gold) {
+      // Extend the valid prefix even if it is no longer in the beam.
+      const ParserSpan &span = gold.stack.back();
+      lmin.assign(span.end - span.bgn, 0);
+      lmax.assign(span.end - span.bgn, 0);
+      rmin.assign(span.end - span.bgn, 0);
+      rmax.assign(span.end - span.bgn, 0);
+      PreCalculateSpan(span, *constraint, lmin, rmin, lmax, rmax);
+      const ParserAction &action = gold.actions[span.action_id];
+      for (int pivot = span.bgn + 1; pivot < span.end; pivot++) {
+        const bool valid_str =
+            lmax[pivot - 1 - span.bgn] < 0 || rmin[pivot - span.bgn] < 0 ||
+            lmax[pivot - 1 - span.bgn] <= rmin[pivot - span.bgn];
+        const bool valid_inv =
+            rmax[pivot - span.bgn] < 0 || lmin[pivot - 1 - span.bgn] < 0 ||
+            rmax[pivot - span.bgn] <= lmin[pivot - 1 - span.bgn];
+        if (!valid_str && !valid_inv)
+          continue;
+        CachedFeatures(sentence, action, span, pivot, cache, features);
+        model.Scores(features, scores);
+        for (const bool label : {false, true}) {
+          if (!(label ? valid_inv : valid_str))
+            continue;
+          const float score = gold.score + scores[label];
+          if (score > oracle_score) {
+            oracle_score = score;
+            oracle = gold;
+            oracle.Advance(ParserAction(pivot, label), score, true);
+          }
+        }
       }
-      old_agenda.pop();
+      has_gold = !oracle.actions.empty();
+      if (has_gold) {
+        gold = oracle;
+      }
+    }
+    CHECK(agenda.size() >= 1, "No valid candidates");
+    if (next.size() < agenda.size())
+      next.resize(agenda.size(), ParserState(0));
+    beam_size = agenda.size();
+    for (size_t b = 0; !agenda.empty(); b++) {
+      const ParserCandidate &candidate = agenda.top();
+      next[b] = beam[candidate.parent];
+      next[b].Advance(candidate.action, candidate.score, candidate.valid);
+      agenda.pop();
     }
-    CHECK(new_agenda.size() >= 1, "No valid candidates");
-    old_agenda.swap(new_agenda);
-    if (constraint != nullptr && num_valid == 0) {
+    beam.swap(next);
+    if (constraint != nullptr && num_valid == 0 && !track_gold) {
       // Early update.
-      nbestActions.resize(1);
-      nbestActions[0] = old_agenda.top().actions;
+      nbest.resize(1, ParserState(0));
+      nbest[0] = beam.front();
       return;
     }
   }
-  nbestActions.resize(old_agenda.size());
-  for (auto it = nbestActions.rbegin(); it != nbestActions.rend(); ++it) {
-    const ParserState &state = old_agenda.top();
+  nbest.resize(beam_size, ParserState(0));
+  for (size_t b = 0; b < beam_size; b++) {
+    const ParserState &state = beam[b];
     CHECK(state.actions.size() == length - 1,
           "Invalid length of an action sequence");
     CHECK(state.stack.size() == 0, "Stack is not empty");
-    *it = state.actions;
-    old_agenda.pop();
+    nbest[beam_size - 1 - b] = state;
+  }
+  // Full derivations are updated as usual, unless an earlier prefix of a
+  // wrong derivation violates the valid one by more.
+  if (track_gold && nbest.front().actions != oracle.actions &&
+      (!has_gold || nbest.front().score - gold.score < max_gap)) {
+    if (has_violation) {
+      nbest.resize(1, ParserState(0));
+      nbest[0] = violation_sys;
+      oracle = violation_ref;
+    }
   }
 }
 
-void Parser::AddState(const ParserState &state,
-                      const std::vector<uint64_t> &features,
+void Parser::AddState(const ParserState &state, int parent, float score,
                       const ParserAction &action, bool valid, Agenda &agenda,
-                      float &oracle_score,
-                      std::vector<ParserAction> &oracle_actions, int &num_valid,
-                      const Model &model) const{
-  // Calculate the score.
-  float score = state.score;
-  // const MiniHashMap<uint64_t, float, Hash> &weights_mapping =
-  //     model.weights[static_cast<size_t>(action.second)];
-  const Weights &weights_mapping =
-      model.weights[static_cast<size_t>(action.second)];
-  for (const uint64_t feature : features) {
-    const auto it = weights_mapping.find(feature);
-    if (it != weights_mapping.end()) {
-      score += it->second;
-    }
-  }
+                      float &oracle_score, ParserState &oracle,
+                      int &num_valid) const{
   if (valid && score > oracle_score) {
     oracle_score = score;
-    oracle_actions = state.actions;
-    oracle_actions.push_back(action);
+    oracle = state;
+    oracle.Advance(action, score, true);
   }
   // Remove the candidate with the least score if the agenda size exceeds the
   // beam size.
@@ -189,7 +301,26 @@ void Parser::AddState(const ParserState &state,
   }
   if (valid)
     num_valid++;
-  agenda.emplace(state, action, score, valid);
+  agenda.emplace(score, valid, parent, action);
+}
+
+void Parser::CachedFeatures(const Sentence &sentence,
+                            const ParserAction &action, const ParserSpan &span,
+                            int pivot, ExampleFeatures *cache,
+                            std::vector<size_t> &features) const {
+  if (cache == nullptr) {
+    ExtractFeatures(sentence, action, span, pivot, features);
+    return;
+  }
+  // The parent label and side are all ExtractFeatures reads of <action>.
+  const uint64_t n = sentence.size() + 1;
+  const uint64_t parent =
+      span.action_id < 0 ? 8 : action.second * 3 + (span.bgn == action.first);
+  const uint64_t key = ((span.bgn * n + span.end) * n + pivot) * 9 + parent;
+  if (cache->Find(key, features))
+    return;
+  ExtractFeatures(sentence, action, span, pivot, features);
+  cache->Insert(key, features);
 }
 
 void Parser::ExtractFeatures(const Sentence &sentence,
@@ -198,7 +329,7 @@ void Parser::ExtractFeatures(const Sentence &sentence,
   std::hash<std::string> hasher;
   static const size_t kFpEmpty = hasher("<s>");
   static const size_t kMaxFeatures = 120;
-  static const size_t kMaxSpanSize = 100;
+  static const size_t kMaxSpanSize = kDenseSubtreeSizes - kDenseTreeSize;
   static const size_t *kFpNumbers = FeatureFingerprintNumbers(kMaxFeatures);
 
   size_t id = 0;
@@ -219,14 +350,17 @@ void Parser::ExtractFeatures(const Sentence &sentence,
   int cl = (rn < ln) ? 0 : (rn > ln) ? 1 : 2;
   int nln = (ln > 5) ? 5 : ln;
   int nrn = (rn > 5) ? 5 : rn;
-  // bias kFpNumbers
-  features.push_back(kFpNumbers[id++]);
+  // The templates up to NT&SIDE are dense; the lexical ones after them keep
+  // their fingerprint numbers.
+  id = 6;
+  // bias
+  features.push_back(kDenseBias);
   // balance of children
-  features.push_back(FeatureFingerPrintCat(kFpNumbers[id++], cl));
+  features.push_back(kDenseBalance + cl);
   // tree size
-  features.push_back(FeatureFingerPrintCat(kFpNumbers[id++], sn));
+  features.push_back(kDenseTreeSize + sn);
   // subtree sizes
-  features.push_back(FeatureFingerPrintCat(kFpNumbers[id++], nln, nrn));
+  features.push_back(kDenseSubtreeSizes + nln * 6 + nrn);
   //************************************************************
   int gp_nt;
   int gp_side;
@@ -238,9 +372,9 @@ void Parser::ExtractFeatures(const Sentence &sentence,
     gp_side = static_cast<int>(span.bgn == action.first);
   }
   // NT
-  features.push_back(FeatureFingerPrintCat(kFpNumbers[id++], gp_nt));
+  features.push_back(kDenseNT + gp_nt);
   // NT&SIDE
-  features.push_back(FeatureFingerPrintCat(kFpNumbers[id++], gp_nt, gp_side));
+  features.push_back(kDenseNTSide + gp_nt * 3 + gp_side);
   //************************************************************
 
   for (int i = 0; i < static_cast<int>(3); i++) {
@@ -344,12 +478,12 @@ void Parser::ExtractFeatures(const Sentence &sentence,
   CHECK(features.size() <= kMaxFeatures, "Too many features");
 }
 
-void Parser::Permute(int threads, const std::vector<Sentence*>& sentences, const std::string &format,
+void Parser::Permute(int threads, const Corpus &corpus, const std::string &format,
                      const Model &model) const {
   ThreadPool pool(threads);
   std::vector<std::future<std::string>> results;
   int i = 0;
-
+  const std::vector<Sentence> &sentences = corpus.sentences;
   
   int step = int(sentences.size()/100);
   for (auto it = sentences.begin(); it != sentences.end(); ++it, i++) {
@@ -363,7 +497,7 @@ void Parser::Permute(int threads, const std::vector<Sentence*>& sentences, const
       std::cerr << std::endl;
     }
     results.emplace_back(
-        pool.enqueue(&Parser::OutputParseResults, *this, std::ref(*(*it)), std::ref(format), std::ref(model)));
+        pool.enqueue(&Parser::OutputParseResults, *this, std::ref(*it), std::ref(format), std::ref(model)));
     if (i % 1000 == 0 && i != 0) {
       for (auto &&result : results) {
         std::cout << result.get() << std::endl;
@@ -381,10 +515,10 @@ void Parser::Permute(int threads, const std::vector<Sentence*>& sentences, const
 std::string Parser::OutputParseResults(const Sentence &sentence,
                                        const std::string &format,
                                        const Model &model) const {
-  std::vector<std::vector<ParserAction>> nbestActions;
-  std::vector<ParserAction> actions_ref;
-  Parse(sentence, nullptr, nbestActions, actions_ref, model);
-  const std::vector<ParserAction> &actions_sys = nbestActions.front();
+  std::vector<ParserState> nbest;
+  ParserState oracle(sentence.size());
+  Parse(sentence, nullptr, nbest, oracle, model);
+  const std::vector<ParserAction> &actions_sys = nbest.front().actions;
   if (format.compare("action") == 0) {
     return ParserActionsToString(actions_sys);
   } else if (format.compare("order") == 0) {
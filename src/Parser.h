@@ -20,6 +20,8 @@
 #include "BaseModel.h"
 #include "Config.h"
 #include "Constraint.h"
+#include "Corpus.h"
+#include "FeatureCache.h"
 #include "Sentence.h"
 
 namespace HieraParser
@@ -28,19 +30,6 @@ namespace HieraParser
 typedef std::pair<int, bool> ParserAction;
 
 
-static void LoadInput(std::vector<Sentence*> &sentences, const std::string &path, const size_t kMaxFactorSize)
-{
-    std::cerr << "Loading input file " << path << std::endl;
-    std::ifstream input_in(path);
-    if (!input_in.good())
-        THROW_ERROR("File not exist!");
-    for (std::string line; !getline(input_in, line).eof();)
-    {
-        sentences.push_back(
-            Sentence::CreateFromString(line, kMaxFactorSize));
-    }
-}
-
 // ***************************************************************************
 // ParserSpan Class
 class ParserSpan
@@ -83,6 +72,19 @@ public:
 
   virtual ~ParserState(){};
 
+  // Make this the initial state for <len> tokens, keeping the storage.
+  void Reset(int len)
+  {
+    score = 0.0;
+    valid = true;
+    stack.clear();
+    actions.clear();
+    if (len >= 2)
+    {
+      stack.emplace_back(0, len, -1);
+    }
+  }
+
   // Change the state by applying the specified action.
   void Advance(const ParserAction &action, float new_score, bool new_valid)
   {
@@ -109,7 +111,20 @@ public:
 };
 // ***************************************************************************
 
-typedef std::priority_queue<ParserState> Agenda;
+// A successor of a state of the beam, built only once it has survived the
+// transition: <parent> indexes the beam and <action> is applied to it.
+struct ParserCandidate
+{
+  ParserCandidate(float s, bool v, int p, const ParserAction &a)
+      : score(s), valid(v), parent(p), action(a){};
+  bool operator<(const ParserCandidate &rhs) const { return (score > rhs.score); }
+  float score;
+  bool valid;
+  int parent;
+  ParserAction action;
+};
+
+typedef std::priority_queue<ParserCandidate> Agenda;
 
 struct BTGTree
 {
@@ -138,21 +153,35 @@ public:
   ~Parser(){};
   
 
+  // Beam search over the derivations of <sentence>; <nbest> are the final
+  // states, best first. With a <constraint>, <oracle> is the best
+  // derivation that satisfies it, without actions if there is none, and
+  // the search stops at the first transition without a valid candidate in
+  // the beam (early update). With <max_violation>, the best valid prefix is
+  // followed outside the beam instead, and if the best derivation is wrong
+  // the result is the best and the valid prefix at the transition where
+  // the score of the best exceeds the valid one by most. The states keep
+  // their scores, so that updates need not score them again. Features are
+  // looked up in and added to <cache>, if any.
   void Parse(const Sentence &sentence, const Constraint *constraint,
-             std::vector<std::vector<ParserAction>> &nbestActions,
-             std::vector<ParserAction> &oracleActions,
-             const Model &model) const;
+             std::vector<ParserState> &nbest, ParserState &oracle,
+             const Model &model, bool max_violation = false,
+             ExampleFeatures *cache = nullptr) const;
 
-  void AddState(const ParserState &state, const std::vector<uint64_t> &features,
+  // Add the successor of <state> by <action>, whose score is <score>.
+  void AddState(const ParserState &state, int parent, float score,
                 const ParserAction &action, bool valid, Agenda &agenda,
-                float &oracle_score, std::vector<ParserAction> &oracle_actions,
-                int &num_valid, const Model &model) const;
+                float &oracle_score, ParserState &oracle, int &num_valid) const;
 
   void ExtractFeatures(const Sentence &sentence, const ParserAction &action,
                        const ParserSpan &span, int pivot,
                        std::vector<size_t> &features) const;
+  // ExtractFeatures through <cache>, which may be null.
+  void CachedFeatures(const Sentence &sentence, const ParserAction &action,
+                      const ParserSpan &span, int pivot, ExampleFeatures *cache,
+                      std::vector<size_t> &features) const;
 
-  void Permute(int threads, const std::vector<Sentence*>& sentences, const std::string &format,
+  void Permute(int threads, const Corpus &corpus, const std::string &format,
                      const Model &model) const;
   std::string OutputParseResults(const Sentence &sentence,
                                  const std::string &format,
@@ -7,32 +7,32 @@
 
 namespace HieraParser
 {
-int Sentence::sid = 0;
-Sentence* Sentence::CreateFromString(const std::string &line, const size_t kMaxFactorSize)
+size_t Sentence::CountTokens(const StringPiece &line)
 {
-    Sentence *ret = new Sentence();
-    ret->clear();
-    std::vector<std::string> parts = StringSplit(line, "\t");
-    assert(parts.size() == kMaxFactorSize);
+    const StringPiece part = line.substr(0, line.find('\t'));
+    size_t n = 1;
+    for (size_t p = part.find(' '); p != std::string::npos; p = part.find(' ', p + 1))
+        n++;
+    return n;
+}
 
-    for (size_t i = 0; i < kMaxFactorSize; i++)
+void Sentence::HashFromString(const StringPiece &line, const size_t kMaxFactorSize,
+                              uint64_t *out)
+{
+    const size_t size = CountTokens(line);
+    std::fill(out, out + size * kMaxFactorSize, 0);
+    PieceSplitter parts(line, '\t');
+    StringPiece part;
+    size_t i = 0;
+    for (; i < kMaxFactorSize && parts.Next(part); i++)
     {
-        std::vector<std::string> tokens = StringSplit(parts[i], " ");
-        assert(tokens.size() > 0);
-        if (i == 0)
-        {
-            if (ret->empty())
-                ret->resize(tokens.size());
-        }
-        for (size_t j = 0; j < tokens.size(); j++)
-        {
-            if ((*ret)[j].empty())
-                (*ret)[j].resize(kMaxFactorSize);
-           (*ret)[j][i] = FeatureFingerprint(tokens[j]);
-        }
+        PieceSplitter tokens(part, ' ');
+        StringPiece token;
+        // the first factor decides the number of tokens.
+        for (size_t j = 0; j < size && tokens.Next(token); j++)
+            out[j * kMaxFactorSize + i] = FeatureFingerprint(token);
     }
-    sid++; 
-    return ret;
+    CHECK(i == kMaxFactorSize, "#ERROR [Sentence], missing factors: " + line.ToString());
 }
 
 // std::string Sentence::GetString() const
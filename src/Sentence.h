@@ -3,29 +3,45 @@
 #include <vector>
 #include <string>
 #include "utils/farmhash.h"
+#include "utils/StringPiece.h"
 using namespace NAMESPACE_FOR_HASH_FUNCTIONS;
 namespace HieraParser
 {
 // Source sentence class.
 
-typedef std::vector<uint64_t> Token;
-typedef std::vector<Token> SentenceTemplate;
-
-inline uint64_t FeatureFingerprint(const std::string &s) {
+inline uint64_t FeatureFingerprint(const StringPiece &s) {
   return Hash64(s.data(), s.size());
 }
 
-class Sentence : public SentenceTemplate
+// A sentence is a view (pointer, length) into the fingerprint arena of a
+// Corpus; the factors of each token are stored next to each other, so
+// sentence[j][i] is the i-th factor of the j-th token.
+class Sentence
 {
   // friend std::ostream &operator<<(std::ostream &, const Sentence &);
-  static int sid;
 public:
-  Sentence(){};
+  Sentence() : data_(nullptr), size_(0), factors_(0){};
+  Sentence(const uint64_t *data, uint32_t size, uint32_t factors)
+      : data_(data), size_(size), factors_(factors){};
   ~Sentence(){};
-  static Sentence *CreateFromString(const std::string &str, const size_t kMaxFactorSize);
-  std::string GetString() const;
-  
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  const uint64_t *operator[](size_t j) const { return data_ + j * factors_; }
+
+  // Number of tokens of the line, as given by its first factor.
+  static size_t CountTokens(const StringPiece &line);
+  // Hash the <kMaxFactorSize> factors of each token of <line> into <out>,
+  // which must hold CountTokens(line) * kMaxFactorSize fingerprints.
+  static void HashFromString(const StringPiece &line, const size_t kMaxFactorSize,
+                             uint64_t *out);
+  // std::string GetString() const;
+
+private:
+  const uint64_t *data_;
+  uint32_t size_;
+  uint32_t factors_;
 };
 
 } // namespace HieraParser
-#endif // SENTENCE_H__
\ No newline at end of file
+#endif // SENTENCE_H__
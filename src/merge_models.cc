@@ -0,0 +1,67 @@
+#include "Config.h"
+#include "BaseModel.h"
+#include "ModelMerge.h"
+#include "utils/StringUtils.h"
+#include <string>
+#include <thread>
+#include <iostream>
+using namespace HieraParser;
+
+int main(int argc, char **argv)
+{
+    //  read arg* and configuration
+    //  EXIT_SUCCESS 0
+    //  EXIT_FAILURE 1
+    Config cfg;
+    int threads = static_cast<int>(std::thread::hardware_concurrency());
+
+    //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    cfg.AddConfigEntry("models", "", "comma-separated paths to the model files to merge.", true);
+    cfg.AddConfigEntry("sizes", "",
+                       "comma-separated numbers of training examples behind each model, "
+                       "used as mixing weights (default: equal weights).",
+                       true);
+    cfg.AddConfigEntry("output", "", "path to the merged model file.", true);
+    cfg.AddConfigEntry("threads", std::to_string(threads), "the number of threads to use for merging.", true);
+    //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+    if (cfg.ReadMainArgs(argc, argv) > 0)
+    {
+        cfg.PrintUsage();
+        return 1;
+    }
+    if (cfg.GetString("models").empty() || cfg.GetString("output").empty())
+    {
+        std::cerr << "Missing the required arguments [-models ?  -output?]" << std::endl;
+        return 1;
+    }
+    const std::vector<std::string> paths = StringSplit(cfg.GetString("models"), ",");
+    std::vector<int> sizes(paths.size(), 1);
+    if (!cfg.GetString("sizes").empty())
+    {
+        const std::vector<std::string> fields = StringSplit(cfg.GetString("sizes"), ",");
+        if (fields.size() != paths.size())
+        {
+            std::cerr << "-sizes needs one number per model." << std::endl;
+            return 1;
+        }
+        for (size_t j = 0; j < fields.size(); j++)
+        {
+            sizes[j] = std::stoi(fields[j]);
+            if (sizes[j] <= 0)
+            {
+                std::cerr << "-sizes must be positive." << std::endl;
+                return 1;
+            }
+        }
+    }
+
+    Model merged;
+    MergeModelFiles(paths, sizes, cfg.GetInt("threads"), merged);
+    std::cerr << "Merged " << paths.size() << " models into "
+              << merged.NumAveraged()
+              << " feature weights." << std::endl;
+    std::cerr << "Saving merged model to:  " << cfg.GetString("output") << std::endl;
+    merged.WriteModel(cfg.GetString("output"));
+    return 0;
+}
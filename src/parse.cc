@@ -4,6 +4,10 @@
 #include "Parser.h"
 #include "Sentence.h"
 #include "BaseModel.h"
+#include "FilteredModel.h"
+#include "HashedModel.h"
+#include <algorithm>
+#include <memory>
 using namespace HieraParser;
 
 int main(int argc, char **argv)
@@ -26,6 +30,10 @@ int main(int argc, char **argv)
     cfg.AddConfigEntry("factors", "3",
                      "the number of factors to represent each token.", true);
     cfg.AddConfigEntry("beam", "20", "maximum beam size during parsing (default 20)", true);
+    cfg.AddConfigEntry("filter_bits", "0", "bits per feature of a Bloom filter that skips the features "
+                                          "missing from the model (default: 0, none)", true);
+    cfg.AddConfigEntry("hash_bits", "0", "fold the weights of the model into a hashed array of 2^k slots "
+                                         "(default: 0, hashed model files are detected)", true);
 
     //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
@@ -44,14 +52,23 @@ int main(int argc, char **argv)
 
     // load input
     Parser parser(cfg);
-    std::vector<Sentence*> sentences;
-    LoadInput(sentences, cfg.GetString("input"), static_cast<size_t>(cfg.GetInt("factors")));
+    Corpus corpus;
+    LoadInput(corpus, cfg.GetString("input"), static_cast<size_t>(cfg.GetInt("factors")), cfg.GetInt("threads"));
 
     // load model
-    Model model(cfg);
-    model.ReadModel(cfg.GetString("model"));
+    const std::string path = cfg.GetString("model");
+    const bool hashed = cfg.GetInt("hash_bits") > 0 || IsHashedModelFile(path);
+    std::unique_ptr<Model> model;
+    // A hashed model has no misses to skip, so it takes no filter.
+    if (hashed)
+        model.reset(new HashedModel(std::max(cfg.GetInt("hash_bits"), 1)));
+    else if (cfg.GetInt("filter_bits") > 0)
+        model.reset(new FilteredModel(cfg, cfg.GetInt("filter_bits")));
+    else
+        model.reset(new Model(cfg));
+    model->ReadModel(path);
 
     // reorder
-    parser.Permute(cfg.GetInt("threads"), sentences, cfg.GetString("format"), model);
+    parser.Permute(cfg.GetInt("threads"), corpus, cfg.GetString("format"), *model);
     return 0;
 }
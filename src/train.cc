@@ -1,9 +1,13 @@
 #include "BaseModel.h"
 #include "Config.h"
+#include "HashedModel.h"
 #include "Sentence.h"
 #include "trainers/BatchTrainer.h"
 #include "trainers/DistributedTrainer.h"
 #include "trainers/IterDistributedTrainer.h"
+#include "trainers/HogwildTrainer.h"
+#include "trainers/NetworkTrainer.h"
+#include "trainers/ParameterServerTrainer.h"
 #include "trainers/TrainerBase.h"
 #include <stdio.h>
 #include <string.h>
@@ -13,6 +17,7 @@
 #include <algorithm>
 #include <iterator>
 #include <iostream>
+#include <memory>
 using namespace HieraParser;
 
 int main(int argc, char **argv) {
@@ -34,13 +39,43 @@ int main(int argc, char **argv) {
                      "which strategy used for training\n"
                      "           [1. batch learning,\n"
                      "            2. distributed learning (para-mix),\n"
-                     "            3. distributed learning (iter-para-mix)]",
+                     "            3. distributed learning (iter-para-mix),\n"
+                     "            4. lock-free asynchronous learning (hogwild),\n"
+                     "            5. asynchronous parameter server]",
                      true);
 
   cfg.AddConfigEntry(
       "threads", std::to_string(threads),
       "the number of threads will be used for training (default: auto detected).",
       true);
+  cfg.AddConfigEntry("table_bits", "22",
+                     "log2 of the number of slots of the shared weight table "
+                     "used by strategy 4 (default: 22).",
+                     true);
+  cfg.AddConfigEntry("mix_interval", "0",
+                     "the number of examples each shard trains on between two "
+                     "mixes of strategy 3 (default: 0, once per iteration).",
+                     true);
+  cfg.AddConfigEntry("staleness", "100",
+                     "the number of examples a worker of strategy 5 may run "
+                     "ahead of the slowest one (default: 100).",
+                     true);
+  cfg.AddConfigEntry("snapshot_interval", "10",
+                     "the number of updates between two snapshots of the "
+                     "master weights in strategy 5 (default: 10).",
+                     true);
+  cfg.AddConfigEntry("world", "1",
+                     "the number of training processes; with more than one, "
+                     "strategies 2 and 3 mix the models of all processes over "
+                     "TCP (default: 1).",
+                     true);
+  cfg.AddConfigEntry("rank", "0",
+                     "the index of this process among -world processes; "
+                     "process 0 coordinates and writes the model (default: 0).",
+                     true);
+  cfg.AddConfigEntry("coordinator", "127.0.0.1:9123",
+                     "host:port of process 0 (default: 127.0.0.1:9123).",
+                     true);
   cfg.AddConfigEntry("factors", "3",
                      "the number of factors to represent each token.", true);
   cfg.AddConfigEntry("batch", "20", "the number of training examples in each mini-batch.", true);
@@ -69,6 +104,59 @@ int main(int argc, char **argv) {
                      true);
   cfg.AddConfigEntry("save_step", "0", "save the model after every k-epochs.",
                      true);
+  cfg.AddConfigEntry("checkpoint", "",
+                     "path to a checkpoint of the whole training state, "
+                     "written after every iteration in the background, with "
+                     "incremental saves in <checkpoint>.log.",
+                     true);
+  cfg.AddConfigEntry("resume", "false",
+                     "continue training from -checkpoint if it exists "
+                     "(default: false).",
+                     true);
+  cfg.AddConfigEntry("seed", "0",
+                     "seed of the shuffles (default: 0, seeded from the clock).",
+                     true);
+  cfg.AddConfigEntry("update", "early",
+                     "where to update a wrong derivation: early, at the first "
+                     "transition that drops every valid candidate from the "
+                     "beam, or maxviolation, at the prefix where the best "
+                     "derivation beats the valid one by most (default: early).",
+                     true);
+  cfg.AddConfigEntry("shrink", "0",
+                     "skip an example in the next k epochs once it was "
+                     "parsed correctly in k epochs in a row, until an epoch "
+                     "has no errors; the epochs after it and the last one "
+                     "train on every example (default: 0, off).",
+                     true);
+  cfg.AddConfigEntry("feature_cache", "0",
+                     "megabytes of features of the training examples to keep "
+                     "across epochs instead of extracting them again "
+                     "(default: 0, off).",
+                     true);
+  cfg.AddConfigEntry("max_features", "0",
+                     "the most features the model may hold; once it holds "
+                     "more, those with the smallest averaged weights are "
+                     "pruned (default: 0, no limit).",
+                     true);
+  cfg.AddConfigEntry("hash_bits", "0",
+                     "train a hashed model whose weights are an array of 2^k "
+                     "slots indexed by the low k bits of the features, with "
+                     "strategy 0, 1 or 4 (default: 0, off).",
+                     true);
+  cfg.AddConfigEntry("init_model", "",
+                     "path to a model to start training from, e.g. to "
+                     "fine-tune it on new or combined data.",
+                     true);
+  cfg.AddConfigEntry("init_updates", "0",
+                     "number of updates averaged into -init_model, which "
+                     "weighs it in the averaged weights (default: 0, only "
+                     "the updates of this run count).",
+                     true);
+  cfg.AddConfigEntry("cache", "",
+                     "path to a binary training cache of the hashed input and "
+                     "filtered constraints, built on the first run and reused "
+                     "while the input files are unchanged.",
+                     true);
   //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 
@@ -91,7 +179,15 @@ int main(int argc, char **argv) {
   // init parser
   TrainerBase *trainer;
   int strategy = cfg.GetInt("strategy");
-  if (strategy == 0) {
+  if (cfg.GetInt("world") > 1) {
+    if (strategy != 2 && strategy != 3) {
+      std::cerr << "Only strategies 2 and 3 support -world > 1" << std::endl;
+      return 1;
+    }
+    std::cerr << "Using " << kbest << "-best Multi-process Trainer..."
+              << std::endl;
+    trainer = new NetworkTrainer(cfg);
+  } else if (strategy == 0) {
     std::cerr << "Using " << kbest << "-best Online Trainer ..." << std::endl;
     trainer = new TrainerBase(cfg);
   } else if (strategy == 1) {
@@ -105,14 +201,58 @@ int main(int argc, char **argv) {
     std::cerr << "Using " << kbest << "-best Iterative Distributed Trainer..."
               << std::endl;
     trainer = new IterDistributedTrainer(cfg);
+  } else if (strategy == 4) {
+    std::cerr << "Using " << kbest << "-best Hogwild Trainer..."
+              << std::endl;
+    trainer = new HogwildTrainer(cfg);
+  } else if (strategy == 5) {
+    std::cerr << "Using " << kbest << "-best Parameter Server Trainer..."
+              << std::endl;
+    trainer = new ParameterServerTrainer(cfg);
+  } else {
+    std::cerr << "Unknown strategy " << strategy << std::endl;
+    return 1;
+  }
+  const int hash_bits = cfg.GetInt("hash_bits");
+  if (hash_bits > 0 && (strategy == 2 || strategy == 3 || strategy == 5 ||
+                        cfg.GetInt("world") > 1 ||
+                        !cfg.GetString("checkpoint").empty() ||
+                        cfg.GetInt("save_step") > 0 || cfg.GetInt("max_features") > 0)) {
+    std::cerr << "-hash_bits only supports strategies 0, 1 and 4, without "
+                 "-checkpoint, -save_step and -max_features" << std::endl;
+    return 1;
   }
-  std::vector<Sentence *> sentences;
-  Model model(cfg);
-  LoadInput(sentences, cfg.GetString("input"),
-            static_cast<size_t>(cfg.GetInt("factors")));
+  Corpus corpus;
+  std::unique_ptr<Model> model_ptr(hash_bits > 0 ? new HashedModel(hash_bits)
+                                                 : new Model(cfg));
+  Model &model = *model_ptr;
   std::vector<TrainingExample> training_examples;
-  LoadConstraint(training_examples, sentences, cfg.GetString("align"));
+  const std::string cache = cfg.GetString("cache");
+  const size_t factors = static_cast<size_t>(cfg.GetInt("factors"));
+  if (cache.empty() ||
+      !LoadTrainingCache(corpus, training_examples, cache, cfg.GetString("input"),
+                         cfg.GetString("align"), factors)) {
+    LoadInput(corpus, cfg.GetString("input"), factors, cfg.GetInt("threads"));
+    LoadConstraint(training_examples, corpus, cfg.GetString("align"),
+                   cfg.GetInt("threads"));
+    if (!cache.empty())
+      WriteTrainingCache(corpus, training_examples, cache,
+                         cfg.GetString("input"), cfg.GetString("align"));
+  }
+  const std::string init_model = cfg.GetString("init_model");
+  if (!init_model.empty()) {
+    // Model files hold averaged weights; both the weights and the averaged
+    // weights start from them.
+    model.ReadModel(init_model);
+    model.CopyWeightsToAveraged();
+    trainer->SetInitialUpdates(cfg.GetInt("init_updates"),
+                               static_cast<int>(training_examples.size()));
+  }
   trainer->Train(training_examples, model);
+  // Finishes the checkpoints and model files still being written.
+  delete trainer;
+  if (cfg.GetInt("rank") != 0)
+    return 0;
 
   std::cerr << "Saving reordering model to:  " << cfg.GetString("model")
             << std::endl;
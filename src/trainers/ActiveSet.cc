@@ -0,0 +1,59 @@
+#include "ActiveSet.h"
+#include "../utils/AssertDef.h"
+
+namespace HieraParser
+{
+
+ActiveSet::ActiveSet(int patience, const std::vector<TrainingExample> &examples)
+    : patience_(static_cast<int8_t>(patience)), first_(nullptr), full_(true),
+      verify_(false), verified_(false), skipped_(0)
+{
+  CHECK(patience > 0 && patience < 128, "-shrink must be between 1 and 127.");
+  const Sentence *last = nullptr;
+  for (const TrainingExample &example : examples)
+  {
+    if (first_ == nullptr || example.first < first_)
+      first_ = example.first;
+    if (last == nullptr || example.first > last)
+      last = example.first;
+  }
+  if (first_ != nullptr)
+    state_.assign(last - first_ + 1, 0);
+}
+
+void ActiveSet::StartEpoch(bool last)
+{
+  verified_ = verified_ || verify_;
+  full_ = last || verified_;
+  verify_ = false;
+  skipped_.store(0, std::memory_order_relaxed);
+}
+
+bool ActiveSet::EndEpoch(int num_errors)
+{
+  verify_ = !full_ && num_errors == 0;
+  return full_;
+}
+
+bool ActiveSet::Active(const Sentence *sentence)
+{
+  int8_t &state = state_[sentence - first_];
+  if (full_ || state >= 0)
+    return true;
+  // One correct parse after the skipped epochs is enough to skip again.
+  if (++state == 0)
+    state = patience_ - 1;
+  skipped_.fetch_add(1, std::memory_order_relaxed);
+  return false;
+}
+
+void ActiveSet::Record(const Sentence *sentence, bool correct)
+{
+  int8_t &state = state_[sentence - first_];
+  if (!correct)
+    state = 0;
+  else if (state >= 0 && ++state >= patience_)
+    state = -patience_;
+}
+
+} // namespace HieraParser
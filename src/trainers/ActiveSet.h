@@ -0,0 +1,53 @@
+#ifndef ACTIVE_SET_H_
+#define ACTIVE_SET_H_
+#include <atomic>
+#include <cstdint>
+#include <vector>
+#include "../Corpus.h"
+
+namespace HieraParser
+{
+
+// Shrinking of the training set: an example parsed correctly in <patience>
+// consecutive epochs is skipped in the next <patience> epochs and then
+// revisited; if it is still correct it is skipped again, otherwise it
+// starts over. A partial epoch without errors is followed by a full one
+// that verifies the skipped examples, and every epoch after that is full
+// too, so that training ends as it would without shrinking: on every
+// example, until an epoch has no errors. Different threads may train on
+// different examples of the same active set at the same time.
+class ActiveSet
+{
+public:
+  ActiveSet(int patience, const std::vector<TrainingExample> &examples);
+
+  // Start an epoch; every example is trained on if <last> or once the
+  // skipped examples have been verified.
+  void StartEpoch(bool last);
+  // End an epoch with <num_errors> errors; returns whether it was a full
+  // one, so that early stopping can trust the error count.
+  bool EndEpoch(int num_errors);
+  // Whether to train on the example of <sentence> in this epoch.
+  bool Active(const Sentence *sentence);
+  // Record whether the example of <sentence> was parsed correctly.
+  void Record(const Sentence *sentence, bool correct);
+  // Examples skipped in this epoch.
+  int skipped() const { return skipped_.load(std::memory_order_relaxed); }
+
+private:
+  const int8_t patience_;
+  // Sentences are views into one corpus array; examples are indexed by
+  // their offset from the first.
+  const Sentence *first_;
+  // >= 0: consecutive epochs parsed correctly; < 0: minus the epochs left
+  // to skip.
+  std::vector<int8_t> state_;
+  bool full_;
+  bool verify_;
+  // A verifying epoch has started; shrinking is over.
+  bool verified_;
+  std::atomic<int> skipped_;
+};
+
+} // namespace HieraParser
+#endif // ACTIVE_SET_H_
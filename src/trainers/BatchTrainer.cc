@@ -12,17 +12,14 @@ BatchTrainer::TrainOneEpoch(int total_updates, int &num_updates,
                             std::vector<TrainingExample> &examples,
                             Model &model) const {
   int l = 0;
-  std::srand(std::time(NULL));
-
-  
-  if (shuffle)
-      std::random_shuffle(examples.begin(), examples.end(), RNG());
-
-  
   auto p = examples.begin();
   std::vector<int> result(2, 0);
-  FeaturesDiff featuresDiff(2);
+  // Every sentence of a mini-batch collects its diff privately; the diffs
+  // are reduced by feature shard once the whole batch is done.
+  std::vector<FeaturesDiff> featuresDiffs(batchSize);
+  std::vector<FeaturesDiff> shards(std::max(threads, 1));
   std::vector<std::future<std::vector<float>>> batch;
+  std::vector<const Sentence *> batch_sentences;
   int step = std::max(static_cast<int>(examples.size() / 70), 1);
 
   while (p < examples.end()) {
@@ -32,29 +29,41 @@ BatchTrainer::TrainOneEpoch(int total_updates, int &num_updates,
     if (static_cast<int>(batch.size()) < batchSize) {
       const Sentence *sentence = p->first;
       const Constraint *constraint = p->second;
-      batch.emplace_back(pool->enqueue(&TrainerBase::TrainOneSentence, *this,
-                                       sentence, constraint, std::ref(model),
-                                       std::ref(featuresDiff)));
+      // A skipped example counts as one without an update.
+      if (active && !active->Active(sentence)) {
+        num_updates++;
+      } else {
+        batch.emplace_back(pool->enqueue(&TrainerBase::TrainOneSentence, *this,
+                                         sentence, constraint, std::ref(model),
+                                         std::ref(featuresDiffs[batch.size()])));
+        batch_sentences.push_back(sentence);
+      }
     }
-    if (static_cast<int>(batch.size()) == batchSize ||
-        l == examples.size() - 1) {
+    if (!batch.empty() && (static_cast<int>(batch.size()) == batchSize ||
+                           l == examples.size() - 1)) {
       float loss = 0.0;
-      for (auto &&b : batch) {
-        const std::vector<float> v = b.get();
+      for (size_t k = 0; k < batch.size(); k++) {
+        const std::vector<float> v = batch[k].get();
         loss += v[0];
         result[0] += v[1];
         result[1] += v[2];
+        if (active)
+          active->Record(batch_sentences[k], v[1] == 0 && v[2] == 0);
         num_updates ++;
       }
+      batch_sentences.clear();
       if (batch_norm){
         loss = loss / static_cast<int>(batch.size());
       }
+      ReduceFeaturesDiffs(featuresDiffs, batch.size(), shards);
+      for (size_t k = 0; k < batch.size(); k++) {
+        featuresDiffs[k].clear();
+      }
       batch.clear();
-      const float coefficient =
-          static_cast<float>(total_updates - num_updates) / total_updates;
-      UpdateWeights(loss, featuresDiff, coefficient, model);
-      for (int i = 0; i < 2; i++) {
-        featuresDiff[i].clear();
+      const float coefficient = AveragingCoefficient(total_updates, num_updates);
+      UpdateWeights(loss, shards.data(), shards.size(), coefficient, model);
+      for (auto &shard : shards) {
+        shard.clear();
       }
       loss = 0.0;
     }
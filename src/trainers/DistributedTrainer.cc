@@ -7,7 +7,8 @@ namespace HieraParser
 void DistributedTrainer::Train(std::vector<TrainingExample> &examples, Model &model)  const
 {
 
-    std::vector<Model> submodels(threads);
+    // Every submodel starts from the weights of -init_model, if any.
+    std::vector<Model> submodels(threads, model);
     std::vector<std::vector<TrainingExample>> shards(threads);
     
     int exampleSize = static_cast<int>(examples.size());
@@ -18,17 +19,70 @@ void DistributedTrainer::Train(std::vector<TrainingExample> &examples, Model &mo
 
     for (size_t i = 0; i < threads; i++)
         total_updates[i] = static_cast<int>(shards[i].size()) * iterations;
-    std::vector<std::future<void>> results;
-    for (int i = 0; i < threads; i++)
-    {
-        results.emplace_back(
-            pool->enqueue(&TrainerBase::Train_, *this, std::ref(shards[i]), std::ref(submodels[i])));
-    }
-    for (auto &&result : results)
+
+    // counters: the number of updates of every submodel, then whether it
+    // stopped early.
+    std::vector<int> counters(2 * threads, 0);
+    std::vector<Model *> models;
+    for (auto &submodel : submodels)
+        models.push_back(&submodel);
+    const int start = ResumeTraining(exampleSize, counters, models);
+    InitActiveSet(examples);
+
+    // Submodels train independently; they only wait for each other at the
+    // end of every iteration so that a checkpoint can be taken.
+    double wall0 = get_wall_time();
+    std::vector<std::future<std::vector<int>>> results(threads);
+    for (int iter = start; iter < iterations; iter++)
     {
-        result.get();
+        StartEpoch(iter);
+        for (int i = 0; i < threads; i++)
+        {
+            if (counters[threads + i])
+                continue;
+            results[i] = pool->enqueue([this, i, iter, &total_updates, &counters,
+                                        &shards, &submodels]() {
+                ShuffleExamples(shards[i], iter, i);
+                return TrainOneEpoch(total_updates[i], counters[i], shards[i],
+                                     submodels[i]);
+            });
+        }
+        int num_errors = 0;
+        int num_unreachables = 0;
+        std::vector<int> shard_errors(threads, 0);
+        for (int i = 0; i < threads; i++)
+        {
+            if (counters[threads + i])
+                continue;
+            std::vector<int> nums = results[i].get();
+            shard_errors[i] = nums[0];
+            num_errors += nums[0];
+            num_unreachables += nums[1];
+        }
+        // Errors only prove convergence after an epoch over every example.
+        const bool full = EndEpoch(num_errors);
+        bool stopped = true;
+        for (int i = 0; i < threads; i++)
+        {
+            if (early_stop && full && shard_errors[i] == 0)
+                counters[threads + i] = 1;
+            stopped = stopped && counters[threads + i];
+        }
+        std::stringstream log_string;
+        log_string << "Iteration=" << iter << ", Errors=" << num_errors
+                   << ", Unreachables=" << num_unreachables;
+        if (active)
+            log_string << ", Skipped=" << active->skipped();
+        log_string << ", Seconds=" << get_wall_time() - wall0 << "                ";
+        std::cerr << log_string.str() << std::endl;
+        SaveCheckpoint(exampleSize, stopped ? iterations : iter + 1, counters,
+                       std::vector<const Model *>(models.begin(), models.end()));
+        if (stopped)
+            break;
     }
-    model.ParaMix(submodels, total_updates); //cached weights
+    model.ParaMix(submodels, total_updates, pool); //cached weights
+    // The submodels are pruned separately, so their union may hold more.
+    LimitFeatures(model);
 }
 
-} // namespace HieraParser
\ No newline at end of file
+} // namespace HieraParser
@@ -0,0 +1,173 @@
+#include "HogwildTrainer.h"
+#include <memory>
+#include "../HashedModel.h"
+#include "../utils/GetTime.h"
+
+namespace HieraParser
+{
+
+float HogwildModel::Score(const std::vector<uint64_t> &features, int label) const
+{
+  float score = 0.0;
+  for (const uint64_t feature : features)
+  {
+    const std::atomic<float> *values = table_.Find(feature);
+    if (values != nullptr)
+      score += values[label].load(std::memory_order_relaxed);
+  }
+  return score;
+}
+
+void HogwildModel::Scores(const std::vector<uint64_t> &features,
+                          float *scores) const
+{
+  scores[0] = scores[1] = 0.0;
+  for (const uint64_t feature : features)
+  {
+    const std::atomic<float> *values = table_.Find(feature);
+    if (values != nullptr)
+    {
+      scores[0] += values[0].load(std::memory_order_relaxed);
+      scores[1] += values[1].load(std::memory_order_relaxed);
+    }
+  }
+}
+
+void HogwildModel::Update(const FeaturesDiff &featuresDiff, const float &tau,
+                          const float &coefficient)
+{
+  for (const DiffEntry &entry : featuresDiff)
+  {
+    const float delta = tau * entry.count;
+    std::atomic<float> *values = table_.FindOrInsert(entry.feature);
+    SharedWeightTable::AtomicAdd(values[entry.label], delta);
+    SharedWeightTable::AtomicAdd(values[2 + entry.label], delta * coefficient);
+  }
+}
+
+void HogwildModel::Export(Model &model) const
+{
+  model.Clear();
+  table_.ForEach([&model](uint64_t feature, const std::atomic<float> *values) {
+    WeightEntry entry;
+    for (int k = 0; k < 4; k++)
+      entry[k] = values[k].load(std::memory_order_relaxed);
+    if (entry != WeightEntry{{0.0, 0.0, 0.0, 0.0}})
+      model.weights[feature] = entry;
+  });
+}
+
+void HogwildModel::Import(const Model &model)
+{
+  model.weights.ForEach([this](uint64_t feature, const WeightEntry &entry) {
+    std::atomic<float> *values = table_.FindOrInsert(feature);
+    for (int k = 0; k < 4; k++)
+      values[k].store(entry[k], std::memory_order_relaxed);
+  });
+}
+
+void HogwildTrainer::TrainShard(int tid, std::vector<TrainingExample> &examples,
+                                Model &model,
+                                std::atomic<int> &num_updates,
+                                int total_updates, int first, int last,
+                                int &stopped) const
+{
+  double wall0 = get_wall_time();
+  FeaturesDiff featuresDiff;
+  for (int iter = first; iter < last && !stopped; ++iter)
+  {
+    int num_errors = 0;
+    int num_unreachables = 0;
+    ShuffleExamples(examples, iter, tid);
+    for (const TrainingExample &example : examples)
+    {
+      const std::vector<float> array =
+          TrainOneSentence(example.first, example.second, model, featuresDiff);
+      num_errors += array[1];
+      num_unreachables += array[2];
+      // The averaging coefficient follows the global update count, so the
+      // averaged weights are weighted as in sequential training.
+      const int n = num_updates.fetch_add(1, std::memory_order_relaxed) + 1;
+      const float coefficient = AveragingCoefficient(total_updates, n);
+      UpdateWeights(array[0], featuresDiff, coefficient, model);
+      featuresDiff.clear();
+    }
+    std::stringstream log_string;
+    log_string << "[Thread " << tid << "] Iteration=" << iter
+               << ", Errors=" << num_errors
+               << ", Unreachables=" << num_unreachables
+               << ", Seconds=" << get_wall_time() - wall0 << "                ";
+    std::cerr << log_string.str() << std::endl;
+    if (early_stop && num_errors == 0)
+      stopped = 1;
+  }
+}
+
+void HogwildTrainer::Train(std::vector<TrainingExample> &examples, Model &model) const
+{
+  HashedModel *hashed = dynamic_cast<HashedModel *>(&model);
+  std::unique_ptr<SharedWeightTable> table;
+  std::unique_ptr<HogwildModel> hogwild;
+  if (hashed == nullptr)
+  {
+    table.reset(new SharedWeightTable(tableBits));
+    hogwild.reset(new HogwildModel(*table));
+  }
+  std::vector<std::vector<TrainingExample>> shards(threads);
+  int exampleSize = static_cast<int>(examples.size());
+  ShardTrainExamples(examples, shards, std::min(threads, exampleSize));
+
+  // counters: the global number of updates, then whether every worker
+  // stopped early.
+  std::vector<int> counters(1 + shards.size(), 0);
+  Model state;
+  const int start = ResumeTraining(exampleSize, counters, {&state});
+  // Start from the checkpoint, or else from the weights of -init_model.
+  if (hogwild)
+    hogwild->Import(start > 0 ? state : model);
+  else
+    hashed->SetShared(true);
+  Model &shared = hogwild ? static_cast<Model &>(*hogwild) : model;
+  std::atomic<int> num_updates(counters[0]);
+  const int total_updates = iterations * exampleSize;
+  // Workers only wait for each other after every iteration when a
+  // checkpoint has to be taken there.
+  const int chunk = checkpoint.empty() ? iterations : 1;
+  for (int first = start; first < iterations; first += chunk)
+  {
+    const int last = std::min(first + chunk, iterations);
+    std::vector<std::future<void>> results;
+    for (size_t i = 0; i < shards.size(); i++)
+    {
+      results.emplace_back(pool->enqueue(&HogwildTrainer::TrainShard, this,
+                                         static_cast<int>(i), std::ref(shards[i]),
+                                         std::ref(shared), std::ref(num_updates),
+                                         total_updates, first, last,
+                                         std::ref(counters[1 + i])));
+    }
+    for (auto &&result : results)
+      result.get();
+    counters[0] = num_updates.load();
+    bool stopped = true;
+    for (size_t i = 0; i < shards.size(); i++)
+      stopped = stopped && counters[1 + i];
+    if (!checkpoint.empty())
+    {
+      hogwild->Export(state);
+      SaveCheckpoint(exampleSize, stopped ? iterations : last, counters, {&state});
+    }
+    if (stopped)
+      break;
+  }
+  if (table)
+    std::cerr << "Shared weight table: " << table->size() << " of "
+              << table->capacity() << " slots used." << std::endl;
+  if (feature_cache)
+    std::cerr << feature_cache->Stats() << std::endl;
+  if (hogwild)
+    hogwild->Export(model);
+  else
+    hashed->SetShared(false);
+}
+
+} // namespace HieraParser
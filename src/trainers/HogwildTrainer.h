@@ -0,0 +1,61 @@
+#ifndef HOGWILD_TRAINER_H_
+#define HOGWILD_TRAINER_H_
+#include <atomic>
+#include "TrainerBase.h"
+#include "../utils/ConcurrentWeightTable.h"
+
+namespace HieraParser
+{
+
+// Per feature, laid out as a WeightEntry: the weights of STR and INV, then
+// their averaged weights.
+typedef ConcurrentWeightTable<4> SharedWeightTable;
+
+// A model whose weights live in a table shared by all workers; scoring and
+// updates go straight to the table without locks.
+class HogwildModel : public Model
+{
+public:
+  HogwildModel(SharedWeightTable &table) : table_(table){};
+  virtual ~HogwildModel(){};
+  float Score(const std::vector<uint64_t> &features, int label) const;
+  void Scores(const std::vector<uint64_t> &features, float *scores) const;
+  void Update(const FeaturesDiff &featuresDiff, const float &tau,
+              const float &coefficient);
+  // Copy the shared weights into the maps of <model>.
+  void Export(Model &model) const;
+  // Copy the maps of <model> into the shared weights.
+  void Import(const Model &model);
+
+private:
+  SharedWeightTable &table_;
+};
+
+// Hogwild-style training: every worker trains on its own shard against the
+// one shared weight table and applies its PA updates with atomic adds, with
+// no locks and no barriers between workers. A HashedModel is its own shared
+// table, so the workers update its array in place.
+class HogwildTrainer : public TrainerBase
+{
+public:
+  HogwildTrainer(const Config &cfg) : TrainerBase(cfg)
+  {
+    pool = new ThreadPool(threads);
+    tableBits = cfg.GetInt("table_bits");
+    if (threads > 1)
+      std::cerr << "Loading [" << threads << "] threads ..." << std::endl;
+  };
+  virtual ~HogwildTrainer(){};
+  void Train(std::vector<TrainingExample> &examples, Model &model) const;
+
+protected:
+  // Train iterations [first, last) of one worker; <stopped> is set once it
+  // stops early.
+  void TrainShard(int tid, std::vector<TrainingExample> &examples,
+                  Model &model, std::atomic<int> &num_updates,
+                  int total_updates, int first, int last, int &stopped) const;
+  int tableBits;
+};
+
+} // namespace HieraParser
+#endif // HOGWILD_TRAINER_H_
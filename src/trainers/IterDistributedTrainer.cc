@@ -8,57 +8,86 @@ namespace HieraParser
 
 void IterDistributedTrainer::Train(std::vector<TrainingExample> &examples, Model &model) const
 {
-    std::vector<Model> submodels(threads);
+    // Workers read the mixed weights of <model> and write their own deltas.
+    std::vector<DeltaModel> submodels(threads);
+    for (auto &submodel : submodels)
+        submodel.SetBase(&model);
     std::vector<std::vector<TrainingExample>> shards(threads);
     int exampleSize = static_cast<int>(examples.size());
     
     ShardTrainExamples(examples, shards, std::min(threads, exampleSize));
     std::vector<std::future<std::vector<int>>> results;
-    std::vector<int> shardSize(threads, 0);
+    // The number of updates of every shard.
     std::vector<int> num_updates(threads, 0);
     std::vector<int> total_updates(threads, 0);
-    for (size_t i = 0; i < threads; i++){
+    for (size_t i = 0; i < shards.size(); i++){
         total_updates[i] =  iterations * static_cast<int>(shards[i].size());
-        shardSize[i] =  static_cast<int>(shards[i].size());
     }
-        
-
 
+    const int start = ResumeTraining(exampleSize, num_updates, {&model});
+    InitActiveSet(examples);
     double wall0 = get_wall_time();
-    for (int iter = 0; iter < iterations; iter++)
+    size_t longest = 0;
+    for (auto &shard : shards)
+        longest = std::max(longest, shard.size());
+    // Every shard trains on <interval> examples between two mixes.
+    const size_t interval = mixInterval > 0 ? static_cast<size_t>(mixInterval) : longest;
+    for (int iter = start; iter < iterations; iter++)
     {
         int num_errors = 0;
         int num_unreachables = 0;
+        int num_mixes = 0;
         std::stringstream log_string;
-        for (size_t i = 0; i < threads; i++)
+        for (size_t i = 0; i < shards.size(); i++)
+            ShuffleExamples(shards[i], iter, i);
+        StartEpoch(iter);
+        for (size_t bgn = 0; bgn < longest; bgn += interval)
         {
-            results.emplace_back(
-                pool->enqueue(&TrainerBase::TrainOneEpoch, *this, total_updates[i],
-                             std::ref(num_updates[i]),
-                             std::ref(shards[i]), std::ref(submodels[i])));
+            std::vector<int> roundSize(threads, 0);
+            for (size_t i = 0; i < shards.size(); i++)
+            {
+                auto first = shards[i].cbegin() + std::min(bgn, shards[i].size());
+                auto last = shards[i].cbegin() + std::min(bgn + interval, shards[i].size());
+                roundSize[i] = static_cast<int>(last - first);
+                results.emplace_back(pool->enqueue([this, i, first, last, &total_updates,
+                                                    &num_updates, &submodels]() {
+                    return TrainExamples(total_updates[i], num_updates[i], first, last,
+                                         submodels[i]);
+                }));
+            }
+            for (auto &&result : results)
+            {
+                std::vector<int> nums = result.get();
+                num_errors += nums[0];
+                num_unreachables += nums[1];
+            }
+            results.clear();
+            // The deltas only hold the features updated since the last mix,
+            // weighted by how many examples each shard saw in this round.
+            MergeDeltas(model, submodels, roundSize, pool);
+            LimitFeatures(model);
+            num_mixes++;
         }
-        for (auto &&result : results)
-        {
-            std::vector<int> nums = result.get();
-            num_errors += nums[0];
-            num_unreachables += nums[1];
-        };
-       
+
         double wall1 = get_wall_time();
         log_string << "Iteration=" << iter << ", Errors=" << num_errors
                    << ", Unreachables=" << num_unreachables
-                   << ", Seconds=" <<  wall1 - wall0  << "                     ";
+                   << ", Mixes=" << num_mixes;
+        if (active)
+            log_string << ", Skipped=" << active->skipped();
+        log_string << ", Seconds=" <<  wall1 - wall0  << "                     ";
         std::cerr << log_string.str() << std::endl;
 
-        model.IterParaMix(submodels, shardSize, (float)(iterations-iter)/iterations);
-        
-        if (early_stop && num_errors == 0)
+        // The deltas are empty after the last mix, so the mixed model and
+        // the update counters are the whole state.
+        const bool full = EndEpoch(num_errors);
+        const bool stop = early_stop && num_errors == 0 && full;
+        SaveCheckpoint(exampleSize, stop ? iterations : iter + 1, num_updates, {&model});
+        if (stop)
             break;
         if (saveStep > 0 && iter % saveStep == 0){ 
-            model.WriteModel(m_path + "." + std::to_string(iter));
+            SaveModel(model, iter);
         }
-        results.clear();
-        
     }
 }
 } // namespace HieraParser
\ No newline at end of file
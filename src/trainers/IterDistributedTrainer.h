@@ -8,12 +8,17 @@ class IterDistributedTrainer : public TrainerBase
 {
   public:
     IterDistributedTrainer(const Config &cfg) : TrainerBase(cfg) {
+      mixInterval = cfg.GetInt("mix_interval");
       pool = new ThreadPool(threads);
       if (threads > 1)
         std::cerr << "Loading [" << threads << "] threads ..." << std::endl;
     };
     virtual ~IterDistributedTrainer(){};
     void Train(std::vector<TrainingExample> &examples, Model &model) const;
+
+  private:
+    // Examples per shard between two mixes (0: once per epoch).
+    int mixInterval;
 };
 }
 
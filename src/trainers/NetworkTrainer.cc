@@ -0,0 +1,256 @@
+#include "NetworkTrainer.h"
+#include "../utils/GetTime.h"
+#include <cstring>
+
+namespace HieraParser
+{
+
+static const uint32_t kMixMagic = 0x584d5048; // "HPMX"
+// A weight entry on the wire: the feature, then its weight.
+static const size_t kEntrySize = sizeof(uint64_t) + sizeof(float);
+
+// Fixed-size head of every message. A process introduces itself with the
+// number of training examples it read and the iteration it starts at; a
+// mix message carries error counts, and the reply of process 0 whether to
+// stop early.
+struct MixHeader
+{
+  uint32_t magic;
+  int32_t rank;
+  int32_t examples;
+  int32_t epoch;
+  int32_t num_errors;
+  int32_t num_unreachables;
+  int32_t stop;
+};
+
+static MixHeader RecvHeader(const Socket &socket)
+{
+  MixHeader header;
+  socket.RecvAll(&header, sizeof(header));
+  CHECK(header.magic == kMixMagic, "Unexpected message from a training process.");
+  return header;
+}
+
+static void PutHeader(std::vector<char> &buffer, const MixHeader &header)
+{
+  const size_t offset = buffer.size();
+  buffer.resize(offset + sizeof(header));
+  std::memcpy(&buffer[offset], &header, sizeof(header));
+}
+
+// Weight <k> of the entries of a model goes over the wire as the number of
+// non-zero ones followed by their (feature, weight) pairs.
+static void PutWeights(std::vector<char> &buffer, const Weights &weights, int k)
+{
+  uint64_t size = 0;
+  weights.ForEach([&size, k](uint64_t, const WeightEntry &entry) {
+    size += entry[k] != 0.0;
+  });
+  const size_t offset = buffer.size();
+  buffer.resize(offset + sizeof(size) + size * kEntrySize);
+  char *p = &buffer[offset];
+  std::memcpy(p, &size, sizeof(size));
+  p += sizeof(size);
+  weights.ForEach([&p, k](uint64_t feature, const WeightEntry &entry) {
+    if (entry[k] == 0.0)
+      return;
+    std::memcpy(p, &feature, sizeof(feature));
+    std::memcpy(p + sizeof(feature), &entry[k], sizeof(float));
+    p += kEntrySize;
+  });
+}
+
+// Weights, then averaged weights, of both labels; the weights are sent
+// empty if !<weights>.
+static void PutModel(std::vector<char> &buffer, const Model &model, bool weights)
+{
+  for (int k = 0; k < 4; k++)
+    PutWeights(buffer, weights || k >= 2 ? model.weights : Weights(), k);
+}
+
+// Add <rate> times the entries of weight <k> read from <socket>.
+static void AddWeights(const Socket &socket, float rate, Weights &weights,
+                       int k, std::vector<char> &scratch)
+{
+  uint64_t size;
+  socket.RecvAll(&size, sizeof(size));
+  scratch.resize(size * kEntrySize);
+  if (size > 0)
+    socket.RecvAll(scratch.data(), scratch.size());
+  for (const char *p = scratch.data(); p < scratch.data() + scratch.size(); p += kEntrySize)
+  {
+    uint64_t feature;
+    float weight;
+    std::memcpy(&feature, p, sizeof(feature));
+    std::memcpy(&weight, p + sizeof(feature), sizeof(weight));
+    weights[feature][k] += weight * rate;
+  }
+}
+
+static void AddModel(const Socket &socket, float rate, Model &model)
+{
+  std::vector<char> scratch;
+  for (int k = 0; k < 4; k++)
+    AddWeights(socket, rate, model.weights, k, scratch);
+}
+
+static void AddModel(const Model &from, float rate, bool weights, Model &model)
+{
+  for (int k = weights ? 0 : 2; k < 4; k++)
+    from.weights.ForEach([&](uint64_t feature, const WeightEntry &entry) {
+      if (entry[k] != 0.0)
+        model.weights[feature][k] += entry[k] * rate;
+    });
+}
+
+NetworkTrainer::NetworkTrainer(const Config &cfg) : TrainerBase(cfg)
+{
+  pool = nullptr;
+  world = cfg.GetInt("world");
+  rank = cfg.GetInt("rank");
+  const std::string address = cfg.GetString("coordinator");
+  const size_t colon = address.rfind(':');
+  CHECK(colon != std::string::npos && colon + 1 < address.size(),
+        "-coordinator must be host:port, got " + address);
+  host = address.substr(0, colon);
+  port = std::stoi(address.substr(colon + 1));
+  CHECK(rank >= 0 && rank < world, "-rank must be between 0 and -world - 1.");
+  // Every process keeps its own checkpoint.
+  if (!checkpoint.empty())
+    checkpoint += "." + std::to_string(rank);
+  std::cerr << "Process [" << rank << "] of [" << world << "] ..." << std::endl;
+}
+
+bool NetworkTrainer::Mix(const Model &local, Model &model,
+                         const std::vector<float> &rates, bool weights,
+                         int &num_errors, int &num_unreachables) const
+{
+  std::vector<char> buffer;
+  if (rank != 0)
+  {
+    PutHeader(buffer, MixHeader{kMixMagic, rank, 0, 0, num_errors, num_unreachables, 0});
+    PutModel(buffer, local, weights);
+    peers[0].SendAll(buffer.data(), buffer.size());
+    const MixHeader reply = RecvHeader(peers[0]);
+    AddModel(peers[0], 1.0, model);
+    num_errors = reply.num_errors;
+    num_unreachables = reply.num_unreachables;
+    return reply.stop != 0;
+  }
+  // Sum the models of all processes in rank order, so the mix does not
+  // depend on which process is ready first.
+  Model mixed;
+  AddModel(local, rates[0], weights, mixed);
+  for (int j = 1; j < world; j++)
+  {
+    const MixHeader header = RecvHeader(peers[j - 1]);
+    CHECK(header.rank == j, "Unexpected message from process " + std::to_string(header.rank));
+    num_errors += header.num_errors;
+    num_unreachables += header.num_unreachables;
+    AddModel(peers[j - 1], rates[j], mixed);
+  }
+  const bool stop = early_stop && num_errors == 0;
+  PutHeader(buffer, MixHeader{kMixMagic, 0, 0, 0, num_errors, num_unreachables, stop});
+  PutModel(buffer, mixed, weights);
+  for (const Socket &peer : peers)
+    peer.SendAll(buffer.data(), buffer.size());
+  AddModel(mixed, 1.0, weights, model);
+  return stop;
+}
+
+void NetworkTrainer::Train(std::vector<TrainingExample> &examples, Model &model) const
+{
+  const int exampleSize = static_cast<int>(examples.size());
+  CHECK(exampleSize >= world, "Fewer training examples than processes.");
+  std::vector<std::vector<TrainingExample>> shards(world);
+  ShardTrainExamples(examples, shards, world);
+  std::vector<float> rates(world);
+  for (int j = 0; j < world; j++)
+    rates[j] = float(shards[j].size()) / exampleSize;
+  std::vector<TrainingExample> &shard = shards[rank];
+
+  // Strategy 2 resumes inside Train_, from the checkpoint of this process.
+  // counters: the number of updates of this process.
+  std::vector<int> counters(1, 0);
+  int &num_updates = counters[0];
+  const int start = trainer_type == 2 ? 0 : ResumeTraining(exampleSize, counters, {&model});
+
+  if (rank == 0)
+  {
+    const Socket server = Socket::Listen(port, world);
+    peers.resize(world - 1);
+    for (int n = 1; n < world; n++)
+    {
+      Socket socket = server.Accept();
+      const MixHeader hello = RecvHeader(socket);
+      CHECK(hello.rank > 0 && hello.rank < world && !peers[hello.rank - 1].valid(),
+            "Unexpected process rank " + std::to_string(hello.rank));
+      CHECK(hello.examples == exampleSize,
+            "Process " + std::to_string(hello.rank) +
+                " read a different number of training examples.");
+      CHECK(hello.epoch == start,
+            "Process " + std::to_string(hello.rank) +
+                " resumed from a different iteration.");
+      peers[hello.rank - 1] = std::move(socket);
+    }
+  }
+  else
+  {
+    peers.clear();
+    peers.push_back(Socket::Connect(host, port, 60));
+    const MixHeader hello{kMixMagic, rank, exampleSize, start, 0, 0, 0};
+    peers[0].SendAll(&hello, sizeof(hello));
+  }
+  std::cerr << "All [" << world << "] processes connected." << std::endl;
+
+  int num_errors = 0;
+  int num_unreachables = 0;
+  if (trainer_type == 2)
+  {
+    // ParaMix: train independently, then mix the averaged weights. The
+    // local model starts from the weights of -init_model, if any.
+    Model local(model);
+    model.Clear();
+    Train_(shard, local);
+    Mix(local, model, rates, false, num_errors, num_unreachables);
+    LimitFeatures(model);
+    return;
+  }
+  // As MergeDeltas: every process trains a delta over the mixed model, and
+  // the mix adds sum_j rate_j * delta_j to it after every iteration.
+  DeltaModel local;
+  local.SetBase(&model);
+  InitActiveSet(shard);
+  const int total_updates = iterations * static_cast<int>(shard.size());
+  double wall0 = get_wall_time();
+  for (int iter = start; iter < iterations; iter++)
+  {
+    ShuffleExamples(shard, iter, rank);
+    StartEpoch(iter);
+    std::vector<int> result = TrainOneEpoch(total_updates, num_updates, shard, local);
+    num_errors = result[0];
+    num_unreachables = result[1];
+    const bool mixed_stop = Mix(local, model, rates, true, num_errors, num_unreachables);
+    // Every process holds the same mix, so they all prune the same features.
+    LimitFeatures(model);
+    // Errors only prove convergence after an epoch over every example.
+    const bool stop = EndEpoch(num_errors) && mixed_stop;
+    local.ClearDelta();
+
+    std::stringstream log_string;
+    log_string << "Iteration=" << iter << ", Errors=" << num_errors
+               << ", Unreachables=" << num_unreachables;
+    if (active)
+      log_string << ", Skipped=" << active->skipped();
+    log_string << ", Seconds=" << get_wall_time() - wall0 << "                     ";
+    std::cerr << log_string.str() << std::endl;
+    SaveCheckpoint(exampleSize, stop ? iterations : iter + 1, counters, {&model});
+    if (stop)
+      break;
+    if (rank == 0 && saveStep > 0 && iter % saveStep == 0)
+      SaveModel(model, iter);
+  }
+}
+
+} // namespace HieraParser
@@ -0,0 +1,42 @@
+#ifndef NETWORK_TRAINER_H_
+#define NETWORK_TRAINER_H_
+#include "TrainerBase.h"
+#include "../utils/Socket.h"
+
+namespace HieraParser
+{
+
+// Multi-process training: each of -world processes trains shard -rank of
+// the corpus with one thread, and the processes mix their models over TCP
+// through process 0, which listens on the port of -coordinator. Strategy 2
+// mixes the averaged weights once after training (ParaMix) and strategy 3
+// adds the deltas of every process, weighted by shard size, to the weights
+// and averaged weights after every iteration, as MergeDeltas does; only the
+// sparse per-process deltas go over the wire. Every process must
+// read the same input and alignment files.
+class NetworkTrainer : public TrainerBase
+{
+public:
+  NetworkTrainer(const Config &cfg);
+  virtual ~NetworkTrainer(){};
+  void Train(std::vector<TrainingExample> &examples, Model &model) const;
+
+protected:
+  // Mix the <local> models of all processes, weighted by <rates>, and add
+  // the result to <model>; only the averaged weights if !<weights>. The
+  // error counts of this process go in and the totals of all come out.
+  // Returns whether early stopping triggered.
+  bool Mix(const Model &local, Model &model, const std::vector<float> &rates,
+           bool weights, int &num_errors, int &num_unreachables) const;
+
+  int world;
+  int rank;
+  std::string host;
+  int port;
+  // Process 0: the connections to processes 1..world-1; the others: the
+  // connection to process 0.
+  mutable std::vector<Socket> peers;
+};
+
+} // namespace HieraParser
+#endif // NETWORK_TRAINER_H_
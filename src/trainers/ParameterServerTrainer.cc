@@ -0,0 +1,401 @@
+#include "ParameterServerTrainer.h"
+#include "../utils/GetTime.h"
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <thread>
+
+namespace HieraParser
+{
+
+PagedWeights::PagedWeights(const Weights &weights) : PagedWeights()
+{
+  weights.ForEach([this](uint64_t feature, const WeightEntry &entry) {
+    Insert(feature) = entry;
+  });
+}
+
+void PagedWeights::Update(const FeaturesDiff &featuresDiff, const float &tau,
+                          const float &coefficient)
+{
+  for (const DiffEntry &entry : featuresDiff)
+  {
+    const float delta = tau * entry.count;
+    WeightEntry &weight = Insert(entry.feature);
+    weight[entry.label] += delta;
+    weight[2 + entry.label] += delta * coefficient;
+  }
+}
+
+WeightEntry &PagedWeights::Insert(uint64_t feature)
+{
+  if (feature < kDenseFeatures)
+    return MutableDense()[feature];
+  if (size_ >= (kPageEntries << bits_))
+    Grow();
+  const auto result =
+      MutablePage(PageOf(feature)).emplace(feature, WeightEntry());
+  if (result.second)
+    size_++;
+  return result.first->second;
+}
+
+// Only the aggregator copies the pointers, so a count of one stays one;
+// the fence orders the last reads of a worker that released the page before
+// the writes.
+template <class T> static T &Unshare(std::shared_ptr<T> &page)
+{
+  if (page.use_count() > 1)
+    page = std::make_shared<T>(*page);
+  else
+    std::atomic_thread_fence(std::memory_order_acquire);
+  return *page;
+}
+
+WeightShard &PagedWeights::MutablePage(size_t p)
+{
+  return Unshare(pages_[p]);
+}
+
+PagedWeights::DenseWeights &PagedWeights::MutableDense()
+{
+  return Unshare(dense_);
+}
+
+void PagedWeights::Grow()
+{
+  // Page p splits into pages 2p and 2p + 1 by the next bit. The old pages
+  // may be shared, so they are left as they are.
+  std::vector<std::shared_ptr<WeightShard>> pages(pages_.size() * 2);
+  for (auto &page : pages)
+    page = std::make_shared<WeightShard>();
+  bits_++;
+  for (const auto &page : pages_)
+    for (const auto &entry : *page)
+      (*pages[PageOf(entry.first)])[entry.first] = entry.second;
+  pages_.swap(pages);
+}
+
+size_t PagedWeights::Prune(size_t target)
+{
+  if (size_ <= target)
+    return 0;
+  std::vector<float> magnitudes;
+  magnitudes.reserve(size_);
+  for (const auto &page : pages_)
+    for (const auto &entry : *page)
+      magnitudes.push_back(PruneMagnitude(entry.second));
+  const float cutoff = PruneCutoff(magnitudes, target);
+  auto dropped = [cutoff](const std::pair<const uint64_t, WeightEntry> &entry) {
+    return PruneMagnitude(entry.second) < cutoff;
+  };
+  size_t num_dropped = 0;
+  for (size_t p = 0; p < pages_.size(); p++)
+  {
+    const WeightShard &shared = *pages_[p];
+    if (std::none_of(shared.begin(), shared.end(), dropped))
+      continue;
+    WeightShard &page = MutablePage(p);
+    for (auto it = page.begin(); it != page.end();)
+    {
+      if (dropped(*it))
+      {
+        it = page.erase(it);
+        num_dropped++;
+      }
+      else
+        ++it;
+    }
+  }
+  size_ -= num_dropped;
+  return num_dropped;
+}
+
+void PagedWeights::CopyTo(Weights &weights) const
+{
+  weights.clear();
+  for (uint64_t feature = 0; feature < kDenseFeatures; feature++)
+    weights[feature] = (*dense_)[feature];
+  for (const auto &page : pages_)
+    for (const auto &entry : *page)
+      weights[entry.first] = entry.second;
+}
+
+// State shared by the workers and the aggregator while they run.
+struct ParameterServerState
+{
+  // Start from the weights of <model> after <updates> updates.
+  ParameterServerState(size_t n, int total, const Model &model, int updates)
+      : progress(new std::atomic<int>[n]), num_workers(n), finished(0),
+        version(0), master(model.weights), total_updates(total),
+        num_updates(updates)
+  {
+    for (size_t i = 0; i < n; i++)
+    {
+      queues.emplace_back(new UpdateQueue(kQueueCapacity));
+      progress[i].store(0, std::memory_order_relaxed);
+    }
+    std::shared_ptr<WeightSnapshot> initial(new WeightSnapshot);
+    initial->weights = master;
+    initial->applied.assign(n, 0);
+    snapshot = initial;
+  }
+  // Examples done by the slowest worker that has not finished yet.
+  int MinProgress() const
+  {
+    int min = INT_MAX;
+    for (size_t i = 0; i < num_workers; i++)
+      min = std::min(min, progress[i].load(std::memory_order_acquire));
+    return min;
+  }
+
+  static const size_t kQueueCapacity = 1024;
+  std::vector<std::unique_ptr<UpdateQueue>> queues;
+  // Examples done by every worker, INT_MAX once it has finished.
+  std::unique_ptr<std::atomic<int>[]> progress;
+  const size_t num_workers;
+  std::atomic<size_t> finished;
+  // Latest snapshot, read and written with std::atomic_load/store, and
+  // a counter bumped after every publish so that workers can poll it.
+  SnapshotPtr snapshot;
+  std::atomic<int> version;
+  // Owned by the aggregator.
+  PagedWeights master;
+  const int total_updates;
+  // Examples trained on by all workers so far; owned by the aggregator.
+  int num_updates;
+};
+
+float ParameterServerModel::Score(const std::vector<uint64_t> &features,
+                                  int label) const
+{
+  float score = 0.0;
+  for (const uint64_t feature : features)
+  {
+    const WeightEntry *entry = snapshot_->weights.Find(feature);
+    if (entry != nullptr)
+      score += (*entry)[label];
+    if (!Touched(feature))
+      continue;
+    entry = weights.Find(feature);
+    if (entry != nullptr)
+      score += (*entry)[label];
+  }
+  return score;
+}
+
+void ParameterServerModel::Scores(const std::vector<uint64_t> &features,
+                                  float *scores) const
+{
+  scores[0] = scores[1] = 0.0;
+  for (const uint64_t feature : features)
+  {
+    const WeightEntry *entry = snapshot_->weights.Find(feature);
+    if (entry != nullptr)
+    {
+      scores[0] += (*entry)[0];
+      scores[1] += (*entry)[1];
+    }
+    if (!Touched(feature))
+      continue;
+    entry = weights.Find(feature);
+    if (entry != nullptr)
+    {
+      scores[0] += (*entry)[0];
+      scores[1] += (*entry)[1];
+    }
+  }
+}
+
+void ParameterServerModel::Update(const FeaturesDiff &featuresDiff,
+                                  const float &tau, const float &coefficient)
+{
+  pending_++;
+  if (featuresDiff.empty())
+    return;
+  DeltaModel::Update(featuresDiff, tau, coefficient);
+  Push(UpdatePtr(new ParameterUpdate{featuresDiff, tau, pending_}));
+  pending_ = 0;
+}
+
+void ParameterServerModel::Flush()
+{
+  if (pending_ == 0)
+    return;
+  Push(UpdatePtr(new ParameterUpdate{FeaturesDiff(), 0.0, pending_}));
+  pending_ = 0;
+}
+
+void ParameterServerModel::Push(const UpdatePtr &update)
+{
+  in_flight_.push_back(update);
+  pushed_++;
+  UpdatePtr message(update);
+  while (!queue_.TryPush(std::move(message)))
+    std::this_thread::yield();
+}
+
+void ParameterServerModel::Pull(const SnapshotPtr &snapshot)
+{
+  // <in_flight_> holds the updates [pushed_ - in_flight_.size(), pushed_).
+  const size_t applied = snapshot->applied[id_];
+  while (pushed_ - in_flight_.size() < applied)
+    in_flight_.pop_front();
+  snapshot_ = snapshot;
+  ClearDelta();
+  for (const UpdatePtr &update : in_flight_)
+    DeltaModel::Update(update->diff, update->tau, 0.0);
+}
+
+void ParameterServerTrainer::TrainShard(size_t id,
+                                        std::vector<TrainingExample> &examples,
+                                        ParameterServerState &state,
+                                        int first, int last, int &stopped) const
+{
+  ParameterServerModel model(id, *state.queues[id]);
+  double wall0 = get_wall_time();
+  FeaturesDiff featuresDiff;
+  int seen = -1;
+  int done = 0;
+  for (int iter = first; iter < last && !stopped; ++iter)
+  {
+    int num_errors = 0;
+    int num_unreachables = 0;
+    ShuffleExamples(examples, iter, id);
+    for (const TrainingExample &example : examples)
+    {
+      state.progress[id].store(done, std::memory_order_release);
+      while (done - state.MinProgress() > staleness)
+        std::this_thread::yield();
+      const int version = state.version.load(std::memory_order_acquire);
+      if (version != seen)
+      {
+        seen = version;
+        model.Pull(std::atomic_load(&state.snapshot));
+      }
+      const std::vector<float> array =
+          TrainOneSentence(example.first, example.second, model, featuresDiff);
+      num_errors += array[1];
+      num_unreachables += array[2];
+      // The aggregator computes the averaging coefficient from the global
+      // update count when it applies the update.
+      UpdateWeights(array[0], featuresDiff, 0.0, model);
+      featuresDiff.clear();
+      done++;
+    }
+    std::stringstream log_string;
+    log_string << "[Thread " << id << "] Iteration=" << iter
+               << ", Errors=" << num_errors
+               << ", Unreachables=" << num_unreachables
+               << ", Seconds=" << get_wall_time() - wall0 << "                ";
+    std::cerr << log_string.str() << std::endl;
+    if (early_stop && num_errors == 0)
+      stopped = 1;
+  }
+  model.Flush();
+  state.progress[id].store(INT_MAX, std::memory_order_release);
+  state.finished.fetch_add(1, std::memory_order_release);
+}
+
+// Updates are applied in the order they are received, and the averaging
+// coefficient of each follows the number of examples trained on by all
+// workers so far, so the averaged weights are the exact average over the
+// sequence of master weights.
+void ParameterServerTrainer::Aggregate(ParameterServerState &state,
+                                       Model &model) const
+{
+  std::vector<size_t> applied(state.num_workers, 0);
+  int &num_updates = state.num_updates;
+  PagedWeights &master = state.master;
+  int num_applied = 0;
+  int num_snapshots = 0;
+  auto publish = [&]() {
+    std::shared_ptr<WeightSnapshot> snapshot(new WeightSnapshot);
+    snapshot->weights = master;
+    snapshot->applied = applied;
+    std::atomic_store(&state.snapshot, SnapshotPtr(snapshot));
+    state.version.fetch_add(1, std::memory_order_release);
+    num_snapshots++;
+  };
+  UpdatePtr update;
+  while (true)
+  {
+    // Once every worker has finished, one more pass sees all the updates.
+    const bool finished =
+        state.finished.load(std::memory_order_acquire) == state.num_workers;
+    bool idle = true;
+    for (size_t i = 0; i < state.num_workers; i++)
+    {
+      while (state.queues[i]->TryPop(update))
+      {
+        idle = false;
+        num_updates += update->examples;
+        const float coefficient =
+            AveragingCoefficient(state.total_updates, num_updates);
+        master.Update(update->diff, update->tau, coefficient);
+        if (max_features > 0 && master.size() > max_features)
+          *num_pruned += master.Prune(max_features - max_features / 8);
+        applied[i]++;
+        if (++num_applied % snapshotInterval == 0)
+          publish();
+      }
+    }
+    if (idle)
+    {
+      if (finished)
+        break;
+      std::this_thread::yield();
+    }
+  }
+  master.CopyTo(model.weights);
+  std::cerr << "Aggregator applied " << num_applied << " updates and published "
+            << num_snapshots << " snapshots." << std::endl;
+}
+
+void ParameterServerTrainer::Train(std::vector<TrainingExample> &examples,
+                                   Model &model) const
+{
+  std::vector<std::vector<TrainingExample>> shards(threads);
+  int exampleSize = static_cast<int>(examples.size());
+  ShardTrainExamples(examples, shards, std::min(threads, exampleSize));
+
+  // counters: the number of updates, then whether every worker stopped
+  // early.
+  std::vector<int> counters(1 + shards.size(), 0);
+  const int start = ResumeTraining(exampleSize, counters, {&model});
+  // Workers only wait for each other after every iteration when a
+  // checkpoint has to be taken there; the queues are drained by then.
+  const int chunk = checkpoint.empty() ? iterations : 1;
+  for (int first = start; first < iterations; first += chunk)
+  {
+    const int last = std::min(first + chunk, iterations);
+    ParameterServerState state(shards.size(), iterations * exampleSize, model,
+                               counters[0]);
+    std::thread aggregator(&ParameterServerTrainer::Aggregate, this,
+                           std::ref(state), std::ref(model));
+    std::vector<std::future<void>> results;
+    for (size_t i = 0; i < shards.size(); i++)
+    {
+      results.emplace_back(pool->enqueue(&ParameterServerTrainer::TrainShard,
+                                         this, i, std::ref(shards[i]),
+                                         std::ref(state), first, last,
+                                         std::ref(counters[1 + i])));
+    }
+    for (auto &&result : results)
+      result.get();
+    aggregator.join();
+    counters[0] = state.num_updates;
+    bool stopped = true;
+    for (size_t i = 0; i < shards.size(); i++)
+      stopped = stopped && counters[1 + i];
+    SaveCheckpoint(exampleSize, stopped ? iterations : last, counters, {&model});
+    if (stopped)
+      break;
+  }
+  if (feature_cache)
+    std::cerr << feature_cache->Stats() << std::endl;
+  if (max_features > 0)
+    std::cerr << "Pruned " << num_pruned->exchange(0) << " features." << std::endl;
+}
+
+} // namespace HieraParser
@@ -0,0 +1,156 @@
+#ifndef PARAMETER_SERVER_TRAINER_H_
+#define PARAMETER_SERVER_TRAINER_H_
+#include <deque>
+#include <memory>
+#include "TrainerBase.h"
+#include "../utils/SPSCQueue.h"
+
+namespace HieraParser
+{
+
+// One PA update streamed from a worker to the aggregator: the weights move
+// by tau * diff. <examples> counts the examples the worker trained on since
+// its previous update, so that the aggregator can follow the global update
+// count of the averaging coefficient.
+struct ParameterUpdate
+{
+  FeaturesDiff diff;
+  float tau;
+  int examples;
+};
+typedef std::shared_ptr<const ParameterUpdate> UpdatePtr;
+typedef SPSCQueue<UpdatePtr> UpdateQueue;
+
+// The aggregator's master weights, in copy-on-write pages split by the top
+// bits of the fingerprint. A copy shares every page, and a shared page is
+// copied when it is first written, so a snapshot costs one pointer per page
+// plus the pages written since the previous snapshot, not a copy of all the
+// weights. The number of pages doubles as the weights grow, so that a page
+// keeps 16 to 32 entries and a write copies little. The dense features are
+// one more page, an array as in Weights.
+class PagedWeights
+{
+public:
+  PagedWeights()
+      : bits_(0), size_(0), pages_(1, std::make_shared<WeightShard>()),
+        dense_(std::make_shared<DenseWeights>())
+  {
+    for (auto &entry : *dense_)
+      entry.fill(0.0);
+  };
+  explicit PagedWeights(const Weights &weights);
+  // Weights of <feature>, or nullptr if it has none.
+  const WeightEntry *Find(uint64_t feature) const
+  {
+    if (feature < kDenseFeatures)
+      return &(*dense_)[feature];
+    const WeightShard &page = *pages_[PageOf(feature)];
+    const auto it = page.find(feature);
+    return it == page.end() ? nullptr : &it->second;
+  }
+  // As Model::Update.
+  void Update(const FeaturesDiff &featuresDiff, const float &tau,
+              const float &coefficient);
+  // Entries in the pages, as Weights::size().
+  size_t size() const { return size_; }
+  // As Model::Prune; only the pages that lose entries are copied.
+  size_t Prune(size_t target);
+  // Replace <weights> with these weights.
+  void CopyTo(Weights &weights) const;
+
+private:
+  typedef std::array<WeightEntry, kDenseFeatures> DenseWeights;
+  static const size_t kPageEntries = 32;
+  size_t PageOf(uint64_t feature) const
+  {
+    return bits_ == 0 ? 0 : static_cast<size_t>(feature >> (64 - bits_));
+  }
+  WeightEntry &Insert(uint64_t feature);
+  // Page <p>, copied first if a snapshot shares it; the dense page alike.
+  WeightShard &MutablePage(size_t p);
+  DenseWeights &MutableDense();
+  // Split every page in two.
+  void Grow();
+
+  int bits_;
+  size_t size_;
+  std::vector<std::shared_ptr<WeightShard>> pages_;
+  std::shared_ptr<DenseWeights> dense_;
+};
+
+// Master weights published by the aggregator. <applied>[i] is the number
+// of updates of worker i they include.
+struct WeightSnapshot
+{
+  PagedWeights weights;
+  std::vector<size_t> applied;
+};
+typedef std::shared_ptr<const WeightSnapshot> SnapshotPtr;
+
+// A worker's view of the master weights: the latest snapshot it pulled plus
+// its own updates that the snapshot does not include yet. Updates are
+// applied to that view and sent to the aggregator.
+class ParameterServerModel : public DeltaModel
+{
+public:
+  ParameterServerModel(size_t id, UpdateQueue &queue)
+      : id_(id), queue_(queue), pushed_(0), pending_(0){};
+  virtual ~ParameterServerModel(){};
+  // The snapshot weights plus the delta.
+  float Score(const std::vector<uint64_t> &features, int label) const;
+  void Scores(const std::vector<uint64_t> &features, float *scores) const;
+  void Update(const FeaturesDiff &featuresDiff, const float &tau,
+              const float &coefficient);
+  // Switch to <snapshot> and replay the updates it is still missing.
+  void Pull(const SnapshotPtr &snapshot);
+  // Send the examples trained on since the last update.
+  void Flush();
+
+private:
+  void Push(const UpdatePtr &update);
+  const size_t id_;
+  UpdateQueue &queue_;
+  SnapshotPtr snapshot_;
+  // Updates sent but not in <snapshot_>, oldest first.
+  std::deque<UpdatePtr> in_flight_;
+  size_t pushed_;
+  int pending_;
+};
+
+struct ParameterServerState;
+
+// Asynchronous parameter-server training: one aggregator thread owns the
+// master weights and applies the updates that the workers stream to it
+// through one lock-free queue each, and publishes a snapshot every
+// -snapshot_interval updates that the workers pull. Workers never wait for
+// each other, except that one that is more than -staleness examples ahead of
+// the slowest unfinished worker blocks until it catches up.
+class ParameterServerTrainer : public TrainerBase
+{
+public:
+  ParameterServerTrainer(const Config &cfg) : TrainerBase(cfg)
+  {
+    pool = new ThreadPool(threads);
+    staleness = cfg.GetInt("staleness");
+    snapshotInterval = cfg.GetInt("snapshot_interval");
+    if (threads > 1)
+      std::cerr << "Loading [" << threads << "] threads ..." << std::endl;
+  };
+  virtual ~ParameterServerTrainer(){};
+  void Train(std::vector<TrainingExample> &examples, Model &model) const;
+
+protected:
+  // Train iterations [first, last) of one worker; <stopped> is set once it
+  // stops early.
+  void TrainShard(size_t id, std::vector<TrainingExample> &examples,
+                  ParameterServerState &state, int first, int last,
+                  int &stopped) const;
+  // Apply the updates to the master weights of <state>, which are copied
+  // into <model> once the workers have finished.
+  void Aggregate(ParameterServerState &state, Model &model) const;
+  int staleness;
+  int snapshotInterval;
+};
+
+} // namespace HieraParser
+#endif // PARAMETER_SERVER_TRAINER_H_
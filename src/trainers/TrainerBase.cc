@@ -4,6 +4,7 @@
 #include "../utils/GetTime.h"
 #include "../utils/TypeDef.h"
 #include "BatchTrainer.h"
+#include <functional>
 #include <future>
 #include <iostream>
 #include <sstream>
@@ -13,6 +14,7 @@ namespace HieraParser {
 TrainerBase::TrainerBase(const Config &cfg) {
   // init trainer
   kbest = cfg.GetInt("kbest");
+  averaging_scale = 1.0;
   iterations = cfg.GetInt("iterations");
   saveStep = cfg.GetInt("save_step");
   threads = cfg.GetInt("threads");
@@ -21,9 +23,122 @@ TrainerBase::TrainerBase(const Config &cfg) {
   m_path = cfg.GetString("model");
   trainer_type = cfg.GetInt("strategy");
   shuffle = cfg.GetBool("shuffle");
+  shrink = cfg.GetInt("shrink");
+  const std::string update = cfg.GetString("update");
+  CHECK(update == "early" || update == "maxviolation",
+        "-update must be early or maxviolation, got " + update);
+  max_violation = update == "maxviolation";
+  CHECK(shrink == 0 || trainer_type <= 3,
+        "-shrink is only supported by strategies 0 to 3.");
+  checkpoint = cfg.GetString("checkpoint");
+  resume = cfg.GetBool("resume");
+  seed = static_cast<uint64_t>(cfg.GetInt("seed"));
+  if (seed == 0)
+    seed = static_cast<uint64_t>(std::time(NULL));
+  CHECK(!resume || !checkpoint.empty(), "-resume needs a -checkpoint path.");
+  if (!checkpoint.empty() || saveStep > 0)
+    writer = std::make_shared<CheckpointWriter>();
+  const int cache_mb = cfg.GetInt("feature_cache");
+  CHECK(cache_mb >= 0, "-feature_cache must not be negative.");
+  if (cache_mb > 0)
+    feature_cache = std::make_shared<FeatureCache>(
+        static_cast<size_t>(cache_mb) << 20);
+  const int max = cfg.GetInt("max_features");
+  CHECK(max >= 0, "-max_features must not be negative.");
+  CHECK(max == 0 || trainer_type != 4,
+        "-max_features is not supported by strategy 4, whose memory is set by -table_bits.");
+  max_features = static_cast<size_t>(max);
+  num_pruned = std::make_shared<std::atomic<size_t>>(0);
   //init_param = cfg.GetBool("init_param");
 }
 
+void TrainerBase::SetInitialUpdates(int init_updates, int examples) {
+  CHECK(init_updates >= 0, "-init_updates must not be negative.");
+  const double total = static_cast<double>(iterations) * examples;
+  averaging_scale = static_cast<float>(total / (total + init_updates));
+}
+
+void TrainerBase::ShuffleExamples(std::vector<TrainingExample> &examples,
+                                  int iter, int stream) const {
+  if (!shuffle)
+    return;
+  // Sentences are views into one corpus array, so sorting by address
+  // restores the corpus order.
+  std::sort(examples.begin(), examples.end(),
+            [](const TrainingExample &a, const TrainingExample &b) {
+              return a.first < b.first;
+            });
+  std::seed_seq seq{static_cast<uint32_t>(seed), static_cast<uint32_t>(seed >> 32),
+                    static_cast<uint32_t>(iter), static_cast<uint32_t>(stream)};
+  std::mt19937 rng(seq);
+  std::shuffle(examples.begin(), examples.end(), rng);
+}
+
+int TrainerBase::ResumeTraining(int examples, std::vector<int> &counters,
+                                const std::vector<Model *> &models) const {
+  if (!resume)
+    return 0;
+  TrainingState state;
+  if (!ReadCheckpoint(checkpoint, state, models)) {
+    std::cerr << "No checkpoint at " << checkpoint << ", starting from scratch."
+              << std::endl;
+    return 0;
+  }
+  CHECK(state.strategy == trainer_type && state.iterations == iterations &&
+            state.counters.size() == counters.size(),
+        "Error, the checkpoint " + checkpoint +
+            " was written with a different -strategy, -iterations or -threads.");
+  CHECK(state.examples == examples,
+        "Error, the checkpoint " + checkpoint + " was written for other training data.");
+  counters = state.counters;
+  seed = state.seed;
+  return state.epoch;
+}
+
+void TrainerBase::SaveCheckpoint(int examples, int epoch,
+                                 const std::vector<int> &counters,
+                                 const std::vector<const Model *> &models) const {
+  if (checkpoint.empty())
+    return;
+  TrainingState state;
+  state.strategy = trainer_type;
+  state.iterations = iterations;
+  state.examples = examples;
+  state.epoch = epoch;
+  state.seed = seed;
+  state.counters = counters;
+  std::vector<FlatModel> flat;
+  for (const Model *model : models)
+    flat.push_back(FlattenModel(*model));
+  writer->SaveCheckpoint(checkpoint, state, std::move(flat));
+}
+
+void TrainerBase::InitActiveSet(
+    const std::vector<TrainingExample> &examples) const {
+  if (shrink > 0)
+    active = std::make_shared<ActiveSet>(shrink, examples);
+}
+
+void TrainerBase::StartEpoch(int iter) const {
+  if (active)
+    active->StartEpoch(iter == iterations - 1);
+}
+
+bool TrainerBase::EndEpoch(int num_errors) const {
+  if (feature_cache)
+    std::cerr << feature_cache->Stats() << std::endl;
+  if (max_features > 0)
+    std::cerr << "Pruned " << num_pruned->exchange(0) << " features." << std::endl;
+  return active ? active->EndEpoch(num_errors) : true;
+}
+
+void TrainerBase::SaveModel(const Model &model, int iter) const {
+  std::vector<FlatWeights> flat(2);
+  for (int i = 0; i < 2; i++)
+    model.weights.Flatten(2 + i, flat[i]);
+  writer->SaveModel(m_path + "." + std::to_string(iter), std::move(flat));
+}
+
 void TrainerBase::ShardTrainExamples(
     const std::vector<TrainingExample> &examples,
     std::vector<std::vector<TrainingExample>> &shards,
@@ -50,83 +165,81 @@ void TrainerBase::ShardTrainExamples(
   std::cerr << "Shards: [" << shard_info.str() << "]" << std::endl;
 }
 
-void TrainerBase::CollectDiffFeatures(
-    float &loss, const Sentence &sentence,
-    const std::vector<ParserAction> &actions_ref,
-    const std::vector<ParserAction> &actions_sys, const Model &model,
-    FeaturesDiff &featuresDiff) const {
-  CHECK(actions_ref.size() == actions_sys.size(),
-        "Inconsistent lengths of action sequences");
-  ParserState state_ref(sentence.size());
-  ParserState state_sys(sentence.size());
-  int start = actions_ref.size();
-  for (size_t i = 0; i < actions_ref.size(); i++) {
-    if (actions_ref[i] != actions_sys[i]) {
-      start = i;
-      break;
-    }
-    state_ref.Advance(actions_ref[i], 0.0, false);
-    state_sys.Advance(actions_sys[i], 0.0, false);
-  }
-  loss += sqrt(static_cast<float>(actions_ref.size() - start));
-  for (size_t i = start; i < actions_ref.size(); i++) {
-    const ParserSpan &span_ref = state_ref.stack.back();
-    const ParserAction &action_ref = actions_ref[i];
-    Counts &features_diff_ref =
-        featuresDiff[static_cast<int>(action_ref.second)];
-    std::vector<size_t> features;
-    parser->ExtractFeatures(sentence, action_ref, span_ref, action_ref.first,
-                            features);
-    // const MiniHashMap<uint64_t, float, Hash> &weights_ref =
-    //     model.weights[static_cast<int>(action_ref.second)];
-    const Weights &weights_ref =
-        model.weights[static_cast<int>(action_ref.second)];
-    for (const size_t feature : features) {
-      const auto it = weights_ref.find(feature);
-      if (it != weights_ref.end()) {
-        loss -= it->second;
-      }
-      std::lock_guard<std::mutex> lock(mtx);
-      if (features_diff_ref.find(feature) == features_diff_ref.end())
-        features_diff_ref[feature] = 1;
-      else
-        features_diff_ref[feature] += 1;
-    }
-    state_ref.Advance(action_ref, 0.0, false);
-
-    const ParserSpan &span_sys = state_sys.stack.back();
-    const ParserAction &action_sys = actions_sys[i];
-    Counts &features_diff_sys =
-        featuresDiff[static_cast<int>(action_sys.second)];
-    // const MiniHashMap<uint64_t, float, Hash> &weights_sys =
-    //     model.weights[static_cast<int>(action_sys.second)];
-    const Weights &weights_sys =
-        model.weights[static_cast<int>(action_sys.second)];
-    parser->ExtractFeatures(sentence, action_sys, span_sys, action_sys.first,
-                            features);
-    for (const size_t feature : features) {
-      const auto it = weights_sys.find(feature);
-      if (it != weights_sys.end()) {
-        loss += it->second;
+float TrainerBase::CollectDiffFeatures(
+    const Sentence &sentence, const ParserState &oracle,
+    const std::vector<ParserState> &nbest, size_t k,
+    FeaturesDiff &featuresDiff, ExampleFeatures *cache) const {
+  // Reused by every example trained on by this thread.
+  static thread_local std::vector<size_t> features;
+  static thread_local std::vector<int> starts;
+  static thread_local ParserState state(0);
+  const std::vector<ParserAction> &actions_ref = oracle.actions;
+  // Add the features of <actions>[i] for i >= <first>, with the parent
+  // actions that Parse scored them with, -1 times for a wrong derivation
+  // and, with <weights>, sum(weights[0..i]) times for the reference.
+  auto add_features = [&](const std::vector<ParserAction> &actions,
+                          size_t first, const int *weights) {
+    state.Reset(sentence.size());
+    int weight = weights != nullptr ? 0 : -1;
+    for (size_t i = 0; i < actions.size(); i++) {
+      const ParserAction &action = actions[i];
+      if (weights != nullptr)
+        weight += weights[i];
+      if (i >= first && weight != 0) {
+        const ParserSpan &span = state.stack.back();
+        const ParserAction parent = span.action_id < 0
+                                        ? ParserAction(0, false)
+                                        : state.actions[span.action_id];
+        parser->CachedFeatures(sentence, parent, span, action.first, cache,
+                               features);
+        const int label = static_cast<int>(action.second);
+        for (const size_t feature : features)
+          featuresDiff.Add(feature, label, weight);
       }
-      std::lock_guard<std::mutex> lock(mtx);
-      if (features_diff_sys.find(feature) == features_diff_sys.end())
-        features_diff_sys[feature] = -1;
-      else
-        features_diff_sys[feature] -= 1;
+      state.Advance(action, 0.0, false);
     }
-    state_sys.Advance(action_sys, 0.0, false);
+  };
+  // Wrong derivations that start to differ from the reference at each
+  // action; the reference is walked once for all of them.
+  starts.assign(actions_ref.size(), 0);
+  size_t first = actions_ref.size();
+  float loss = 0.0;
+  for (size_t j = 0; j < std::min(nbest.size(), k); j++) {
+    const std::vector<ParserAction> &actions_sys = nbest[j].actions;
+    CHECK(actions_ref.size() == actions_sys.size(),
+          "Inconsistent lengths of action sequences");
+    const size_t start = std::mismatch(actions_ref.begin(), actions_ref.end(),
+                                       actions_sys.begin()).first -
+                         actions_ref.begin();
+    if (start == actions_ref.size())
+      continue;
+    starts[start]++;
+    first = std::min(first, start);
+    // The common prefix scores the same in both, so the scores of the
+    // differing suffixes are the difference of the totals from Parse.
+    loss += sqrt(static_cast<float>(actions_ref.size() - start)) +
+            nbest[j].score - oracle.score;
+    add_features(actions_sys, start, nullptr);
   }
+  add_features(actions_ref, first, starts.data());
+  featuresDiff.Combine();
+  return loss;
 }
 
 void TrainerBase::Train_(std::vector<TrainingExample> &examples,
                          Model &model) const {
-  int num_updates = 0;
+  // counters: the number of updates so far.
+  std::vector<int> counters(1, 0);
+  int &num_updates = counters[0];
   int total_updates = iterations * examples.size();
+  const int start = ResumeTraining(examples.size(), counters, {&model});
+  InitActiveSet(examples);
   double wall0 = get_wall_time();
-  for (int iter = 0; iter < iterations; ++iter) {
+  for (int iter = start; iter < iterations; ++iter) {
     std::stringstream log_string;
 
+    ShuffleExamples(examples, iter, 0);
+    StartEpoch(iter);
     std::vector<int> result =
         this->TrainOneEpoch(total_updates, num_updates, examples, model);
     int num_errors = result[0];
@@ -134,14 +247,20 @@ void TrainerBase::Train_(std::vector<TrainingExample> &examples,
     double wall1 = get_wall_time();
 
     log_string << "Iteration=" << iter << ", Errors=" << num_errors
-               << ", Unreachables=" << num_unreachables
-               << ", Seconds=" << wall1 - wall0 << "                ";
+               << ", Unreachables=" << num_unreachables;
+    if (active)
+      log_string << ", Skipped=" << active->skipped();
+    log_string << ", Seconds=" << wall1 - wall0 << "                ";
     std::cerr << log_string.str() << std::endl;
-    if (early_stop && num_errors == 0)
+    // Errors only prove convergence after an epoch over every example.
+    const bool full = EndEpoch(num_errors);
+    const bool stop = early_stop && num_errors == 0 && full;
+    SaveCheckpoint(examples.size(), stop ? iterations : iter + 1, counters, {&model});
+    if (stop)
       break;
     if (trainer_type != 2) {
       if (saveStep > 0 && iter % saveStep == 0)
-        model.WriteModel(m_path + "." + std::to_string(iter));
+        SaveModel(model, iter);
     }
   }
 }
@@ -209,34 +328,46 @@ std::vector<int>
 TrainerBase::TrainOneEpoch(int total_updates, int &num_updates,
                            std::vector<TrainingExample> &examples,
                            Model &model) const {
+  return TrainExamples(total_updates, num_updates, examples.begin(),
+                       examples.end(), model);
+}
+
+std::vector<int>
+TrainerBase::TrainExamples(int total_updates, int &num_updates,
+                           std::vector<TrainingExample>::const_iterator first,
+                           std::vector<TrainingExample>::const_iterator last,
+                           Model &model) const {
   int l = 0;
   std::vector<int> result(2, 0);
-  std::srand(std::time(NULL));
-  if (shuffle)
-      std::random_shuffle(examples.begin(), examples.end(), RNG());
-  auto example = examples.begin();
-  int step = std::max(static_cast<int>(examples.size() / 70), 1);
-  for (; example < examples.end(); ++example, l++) {
+  const int size = static_cast<int>(last - first);
+  int step = std::max(static_cast<int>(size / 70), 1);
+  // Cleared after every update, but keeps its storage.
+  FeaturesDiff featuresDiff;
+  for (auto example = first; example < last; ++example, l++) {
     // if (l % step == 0 && l != 0 && trainer_type != 2 )
     if (l % step == 0 && l != 0) {
-      show_bar(-1, l, examples.size());
+      show_bar(-1, l, size);
     }
-    FeaturesDiff featuresDiff(2);
     const Sentence *sentence = example->first;
     const Constraint *constraint = example->second;
+    // A skipped example counts as one without an update, so the averaging
+    // stays the same as long as it would still be parsed correctly.
+    if (active && !active->Active(sentence)) {
+      num_updates++;
+      continue;
+    }
     const std::vector<float> array =
         this->TrainOneSentence(sentence, constraint, model, featuresDiff);
     float loss = array[0];
     result[0] += array[1];
     result[1] += array[2];
+    if (active)
+      active->Record(sentence, array[1] == 0 && array[2] == 0);
     num_updates++;
-    const float coefficient =
-        static_cast<float>(total_updates - num_updates) / total_updates;
+    const float coefficient = AveragingCoefficient(total_updates, num_updates);
     UpdateWeights(loss, featuresDiff, coefficient, model);
-    for (int i = 0; i < 2; i++) {
-      featuresDiff[i].clear();
-    }
-    
+    featuresDiff.clear();
+
   }
   return result;
 }
@@ -246,60 +377,70 @@ TrainerBase::TrainOneSentence(const Sentence *sentence,
                               const Constraint *constraint, const Model &model,
                               FeaturesDiff &featuresDiff) const {
   std::vector<float> ret(3, 0);
-  std::vector<std::vector<ParserAction>> nbestActions;
-  std::vector<ParserAction> actions_ref;
-  parser->Parse(*sentence, constraint, nbestActions, actions_ref, model);
-  const std::vector<ParserAction> &actions_sys = nbestActions.front();
-  // if (actions_ref.empty()) {
-  //   ret[2]++;
-  // } else if (actions_sys.size() != sentence->size() - 1 ||
-  //            actions_sys != actions_ref) {
-  //   ret[1]++;
-  //   this->
-  // }
+  // Reused by every example trained on by this thread.
+  static thread_local std::vector<ParserState> nbest;
+  static thread_local ParserState oracle(0);
+  ExampleFeatures *cache =
+      feature_cache ? feature_cache->Get(sentence) : nullptr;
+  parser->Parse(*sentence, constraint, nbest, oracle, model, max_violation,
+                cache);
+  const std::vector<ParserAction> &actions_ref = oracle.actions;
+  const std::vector<ParserAction> &actions_sys = nbest.front().actions;
 
   if (actions_ref.empty())
   {
     ret[2]++;
   }
-  else if(actions_sys == actions_ref)
-  {
-      return ret;
-  }
-  else 
+  else if(actions_sys != actions_ref)
   {
       ret[1]++;
-      for(size_t i=0; i < std::min(nbestActions.size(), static_cast<size_t>(kbest)); i++)
-      {
-          const std::vector<ParserAction> &actions_sys = nbestActions[i];
-          if (actions_sys.size() != sentence->size() - 1 || actions_sys != actions_ref)
-              CollectDiffFeatures(ret[0], *sentence, actions_ref, actions_sys, model,
-                      featuresDiff);
-          
-      } 
+      ret[0] = CollectDiffFeatures(*sentence, oracle, nbest, kbest,
+                                   featuresDiff, cache);
   }
+  if (cache != nullptr)
+    cache->Sweep();
   return ret;
 }
 
 void TrainerBase::UpdateWeights(float loss, const FeaturesDiff &featuresDiff,
                                 float coefficient, Model &model) const {
-  // Calculate tau.
+  UpdateWeights(loss, &featuresDiff, 1, coefficient, model);
+}
+
+void TrainerBase::UpdateWeights(float loss, const FeaturesDiff *shards,
+                                size_t n, float coefficient,
+                                Model &model) const {
+  // Calculate tau from the norms of the combined shards.
   float sq_norm = 0;
-  for (int i = 0; i < 2; i++) {
-    for (auto it = featuresDiff[i].begin(); it != featuresDiff[i].end(); ++it) {
-      if (it->second != 0.0) {
-        sq_norm += it->second * it->second;
-      }
-    }
-  }
+  for (size_t s = 0; s < n; s++)
+    sq_norm += shards[s].sq_norm();
   float tau = std::min(static_cast<float>(1.0), loss / sq_norm);
-  for (int i = 0; i < 2; i++) {
-    for (auto it = featuresDiff[i].begin(); it != featuresDiff[i].end(); ++it) {
-      if (it->second != 0.0) {
-        model.weights[i][it->first] += tau * it->second;
-        model.cached_weights[i][it->first] += tau * it->second * coefficient;
-      }
-    }
+  for (size_t s = 0; s < n; s++) {
+    model.Update(shards[s], tau, coefficient);
+  }
+  LimitFeatures(model);
+}
+
+void TrainerBase::LimitFeatures(Model &model) const {
+  if (max_features == 0 || model.weights.size() <= max_features)
+    return;
+  *num_pruned += model.Prune(max_features - max_features / 8);
+}
+
+void TrainerBase::ReduceFeaturesDiffs(const std::vector<FeaturesDiff> &diffs,
+                                      size_t n,
+                                      std::vector<FeaturesDiff> &shards) const {
+  const size_t num_shards = shards.size();
+  std::vector<std::future<void>> results;
+  for (size_t p = 0; p < num_shards; p++) {
+    results.emplace_back(pool->enqueue([&diffs, &shards, n, num_shards, p]() {
+      FeaturesDiff &shard = shards[p];
+      for (size_t d = 0; d < n; d++)
+        shard.AppendShard(diffs[d], p, num_shards);
+      shard.Combine();
+    }));
   }
+  for (auto &&result : results)
+    result.get();
 }
 } // namespace HieraParser
\ No newline at end of file
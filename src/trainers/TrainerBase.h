@@ -1,14 +1,19 @@
 #ifndef TRAINER_H_
 #define TRAINER_H_
 #include "../BaseModel.h"
+#include "ActiveSet.h"
+#include "../Checkpoint.h"
 #include "../Config.h"
 #include "../Constraint.h"
+#include "../Corpus.h"
 #include "../Parser.h"
 #include "../Sentence.h"
 #include "../utils/AssertDef.h"
 #include "../utils/ProgressBar.h"
 #include "../utils/ThreadPool.h"
 #include "../utils/TypeDef.h"
+#include <atomic>
+#include <memory>
 #include <numeric>
 #include <thread>
 #include <vector>
@@ -24,37 +29,11 @@ namespace HieraParser
 {
 
 
-typedef std::pair<Sentence *, Constraint *> TrainingExample;
-
 struct RNG {
     int operator() (int n) {
         return static_cast<int>(std::rand()/(static_cast<double>(RAND_MAX)+1) * n);
     }
 };
-static void LoadConstraint(std::vector<TrainingExample> &training_examples, std::vector<Sentence *> &sentences,
-                           const std::string &path)
-{
-  std::ifstream input_in(path);
-  if (!input_in.good())
-    THROW_ERROR("File not exist!");
-  size_t i = 0;
-  auto it = sentences.begin();
-  std::string line;
-  for (; it != sentences.end() && !getline(input_in, line).eof(); ++it, ++i)
-  {
-    std::cerr << std::flush << i << '\r' ;
-    Constraint *constraint = Constraint::CreateFromString(line);
-    if (constraint != nullptr)
-    {
-      training_examples.emplace_back(*it, constraint);
-    }
-  }
-  std::cerr << std::flush ;
-  std::cerr << "# Number of training examples: " << training_examples.size()
-            << std::endl;
-}
-
-
 static void show_bar(int tid, int step, int total)
 {
   std::stringstream log_string;
@@ -66,19 +45,20 @@ static void show_bar(int tid, int step, int total)
     std::cerr << std::flush << ProgressBar(step, total, " ") << "\r";
   }
 };
-static std::mutex mtx;
 class TrainerBase
 {
 public:
   TrainerBase(const Config &cfg);
   virtual ~TrainerBase(){};
 
-  void CollectDiffFeatures(
-      float &loss,
-      const Sentence &sentence,
-      const std::vector<ParserAction> &actions_ref,
-      const std::vector<ParserAction> &actions_sys, const Model &model,
-      FeaturesDiff &featuresDiff) const; // return loss per-sentence
+  // Add the features of <oracle> minus those of the wrong derivations among
+  // the first <k> of <nbest>, from where each of them starts to differ, to
+  // <featuresDiff> and combine it; returns the loss summed over them. The
+  // scores are the ones of Parse.
+  float CollectDiffFeatures(
+      const Sentence &sentence, const ParserState &oracle,
+      const std::vector<ParserState> &nbest, size_t k,
+      FeaturesDiff &featuresDiff, ExampleFeatures *cache = nullptr) const;
   virtual void Train(std::vector<TrainingExample> &examples, Model &model) const{
     this->Train_(examples, model);
   };
@@ -86,10 +66,32 @@ public:
   virtual std::vector<int> TrainOneEpoch(int total_updates, int &num_updates,
                                          std::vector<TrainingExample> &examples,
                                          Model &model) const;
+  // Train on [first, last) in order with one update per example.
+  std::vector<int> TrainExamples(int total_updates, int &num_updates,
+                                 std::vector<TrainingExample>::const_iterator first,
+                                 std::vector<TrainingExample>::const_iterator last,
+                                 Model &model) const;
 
   virtual std::vector<float> TrainOneSentence(const Sentence *sentence, const Constraint *constraint,
                                       const Model &model, FeaturesDiff &featuresDiff) const;
 
+  // Shuffle <examples>, a shard of the corpus, for epoch <iter> of worker
+  // <stream>. The order only depends on the seed, the epoch and the
+  // worker, not on the current order, so that training resumed from a
+  // checkpoint sees the same orders as an uninterrupted run.
+  void ShuffleExamples(std::vector<TrainingExample> &examples, int iter,
+                       int stream) const;
+
+  // Weigh the averaged weights of -init_model, which training starts from,
+  // as the average of <init_updates> earlier updates against the
+  // iterations * <examples> updates of this run.
+  void SetInitialUpdates(int init_updates, int examples);
+  // Averaging coefficient of update <num_updates> of <total_updates>.
+  float AveragingCoefficient(int total_updates, int num_updates) const {
+    return static_cast<float>(total_updates - num_updates) / total_updates *
+           averaging_scale;
+  }
+
   void ShardTrainExamples(const std::vector<TrainingExample> &examples,
                           std::vector<std::vector<TrainingExample>> &shards,
                           const int &shardSize) const;
@@ -100,8 +102,42 @@ public:
       float loss,
       const FeaturesDiff &featuresDiff,
       float coefficient, Model &model) const;
+  // Update with a diff split into <n> disjoint shards of the feature space.
+  void UpdateWeights(
+      float loss,
+      const FeaturesDiff *shards, size_t n,
+      float coefficient, Model &model) const;
+
+  // With -max_features, prune <model> once it holds more features; it
+  // keeps 7/8 of them, so that pruning is not needed after every update.
+  void LimitFeatures(Model &model) const;
+
+  // Sum the first <n> per-task diffs into <shards> on the thread pool; shard
+  // p collects and combines the features with (feature % shards.size()) ==
+  // p, so every task writes to its own diff and no lock is needed.
+  void ReduceFeaturesDiffs(const std::vector<FeaturesDiff> &diffs, size_t n,
+                           std::vector<FeaturesDiff> &shards) const;
 
 protected:
+  // With -resume, restore the state saved in -checkpoint into <counters>
+  // (whose size is checked) and <models>, and return the number of epochs
+  // it completed; 0 when training starts from scratch.
+  int ResumeTraining(int examples, std::vector<int> &counters,
+                     const std::vector<Model *> &models) const;
+  // Save the state after <epoch> completed epochs to -checkpoint, if set.
+  void SaveCheckpoint(int examples, int epoch, const std::vector<int> &counters,
+                      const std::vector<const Model *> &models) const;
+  // With -shrink, track which of <examples> to skip in later epochs.
+  void InitActiveSet(const std::vector<TrainingExample> &examples) const;
+  // Start epoch <iter> of the active set, if any.
+  void StartEpoch(int iter) const;
+  // End an epoch with <num_errors> errors over all shards; returns whether
+  // it trained on every example, which is always the case without -shrink.
+  bool EndEpoch(int num_errors) const;
+  // Save the averaged weights of <model> after iteration <iter> next to
+  // -model. Both are written in the background by <writer>.
+  void SaveModel(const Model &model, int iter) const;
+
   ThreadPool *pool;
   Parser *parser;
   std::string m_path;
@@ -112,7 +148,30 @@ protected:
   int saveStep;
   int trainer_type;
   int kbest;
+  // Share of this run in the averaged weights; below 1 after
+  // SetInitialUpdates.
+  float averaging_scale;
   bool shuffle;
+  std::string checkpoint;
+  bool resume;
+  // Seed of the shuffles; replaced by the one of a resumed checkpoint.
+  mutable uint64_t seed;
+  int shrink;
+  // Update at the prefix of maximum violation instead of early update.
+  bool max_violation;
+  // Examples skipped by TrainExamples, with -shrink.
+  mutable std::shared_ptr<ActiveSet> active;
+  // Most features a model may hold, with -max_features; 0 for no limit.
+  size_t max_features;
+  // Features dropped by LimitFeatures since the last epoch; shared by the
+  // copies of a trainer.
+  std::shared_ptr<std::atomic<size_t>> num_pruned;
+  // Features of the training examples kept across epochs, with
+  // -feature_cache; shared by the copies of a trainer.
+  std::shared_ptr<FeatureCache> feature_cache;
+  // Shared by the copies of a trainer; finishes its writes when the last
+  // one is destroyed.
+  std::shared_ptr<CheckpointWriter> writer;
 };
 
 } // namespace HieraParser
@@ -0,0 +1,73 @@
+#ifndef BLOOM_FILTER_H
+#define BLOOM_FILTER_H
+
+#include <cstdint>
+#include <vector>
+
+// Split-block Bloom filter over 64-bit fingerprints: every key sets one bit
+// in each of the eight 32-bit words of one 32-byte block, so a lookup
+// touches a single cache line. With 10 bits per key about 1% of the keys
+// that were never added pass. The keys must already be well mixed, as the
+// feature fingerprints are: the high half picks the block and the low half
+// the bits.
+class BloomFilter
+{
+public:
+    BloomFilter(size_t keys, int bits_per_key)
+        : num_blocks_(keys * bits_per_key / kBlockBits + 1),
+          storage_((num_blocks_ + 1) * kWords, 0)
+    {
+        // Align the blocks to their size, so that none straddles two cache
+        // lines.
+        const uintptr_t address = reinterpret_cast<uintptr_t>(storage_.data());
+        words_ = storage_.data() + (-address % kBlockBytes) / sizeof(uint32_t);
+    }
+
+    void Add(uint64_t key)
+    {
+        uint32_t *block = words_ + BlockOf(key) * kWords;
+        const uint32_t low = static_cast<uint32_t>(key);
+        for (int i = 0; i < kWords; i++)
+            block[i] |= Mask(low, i);
+    }
+
+    // False if <key> was certainly never added.
+    bool MayContain(uint64_t key) const
+    {
+        const uint32_t *block = words_ + BlockOf(key) * kWords;
+        const uint32_t low = static_cast<uint32_t>(key);
+        for (int i = 0; i < kWords; i++)
+            if ((block[i] & Mask(low, i)) == 0)
+                return false;
+        return true;
+    }
+
+    size_t bytes() const { return num_blocks_ * kBlockBytes; }
+
+private:
+    static const int kWords = 8;
+    static const size_t kBlockBytes = kWords * sizeof(uint32_t);
+    static const size_t kBlockBits = kBlockBytes * 8;
+
+    size_t BlockOf(uint64_t key) const
+    {
+        return static_cast<size_t>(((key >> 32) * num_blocks_) >> 32);
+    }
+    static uint32_t Mask(uint32_t low, int i)
+    {
+        // The salts of the Parquet split-block filter.
+        static const uint32_t kSalts[kWords] = {
+            0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+            0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U};
+        return uint32_t(1) << ((low * kSalts[i]) >> 27);
+    }
+
+    BloomFilter(const BloomFilter &);
+    BloomFilter &operator=(const BloomFilter &);
+
+    const size_t num_blocks_;
+    std::vector<uint32_t> storage_;
+    uint32_t *words_;
+};
+
+#endif // BLOOM_FILTER_H
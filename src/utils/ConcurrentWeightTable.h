@@ -0,0 +1,128 @@
+#ifndef CONCURRENT_WEIGHT_TABLE_H
+#define CONCURRENT_WEIGHT_TABLE_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include "AssertDef.h"
+
+// Fixed-capacity open-addressing table from 64-bit feature fingerprints to
+// <N> float weights, which many threads can read, insert into and update at
+// the same time without locks. Keys are claimed with a CAS on an empty slot
+// and are never removed, so a reader either sees a key with valid (zero
+// initialized) weights or keeps probing; weights are changed with relaxed
+// CAS-based float additions.
+template <int N>
+class ConcurrentWeightTable
+{
+public:
+    explicit ConcurrentWeightTable(int bits)
+        : capacity_(static_cast<size_t>(1) << bits), mask_(capacity_ - 1),
+          entries_(new Entry[capacity_]), size_(0), has_empty_key_(false)
+    {
+        for (size_t i = 0; i < capacity_; i++)
+            Reset(entries_[i]);
+        Reset(empty_key_entry_);
+    }
+
+    size_t size() const { return size_.load(std::memory_order_relaxed); }
+    size_t capacity() const { return capacity_; }
+
+    // Weights of <key>, or nullptr if it has never been inserted.
+    const std::atomic<float> *Find(uint64_t key) const
+    {
+        if (key == kEmpty)
+            return has_empty_key_.load(std::memory_order_acquire)
+                       ? empty_key_entry_.values
+                       : nullptr;
+        for (size_t i = key & mask_;; i = (i + 1) & mask_)
+        {
+            const uint64_t k = entries_[i].key.load(std::memory_order_acquire);
+            if (k == key)
+                return entries_[i].values;
+            if (k == kEmpty)
+                return nullptr;
+        }
+    }
+
+    // Weights of <key>, inserting zero weights if it is not in the table.
+    std::atomic<float> *FindOrInsert(uint64_t key)
+    {
+        if (key == kEmpty)
+        {
+            has_empty_key_.store(true, std::memory_order_release);
+            return empty_key_entry_.values;
+        }
+        for (size_t i = key & mask_;; i = (i + 1) & mask_)
+        {
+            uint64_t k = entries_[i].key.load(std::memory_order_acquire);
+            if (k == key)
+                return entries_[i].values;
+            if (k == kEmpty)
+            {
+                if (entries_[i].key.compare_exchange_strong(
+                        k, key, std::memory_order_acq_rel))
+                {
+                    const size_t n = size_.fetch_add(1, std::memory_order_relaxed) + 1;
+                    CHECK(n < capacity_ / 10 * 9,
+                          "Weight table is full (" + std::to_string(capacity_) +
+                              " slots), increase -table_bits.");
+                    return entries_[i].values;
+                }
+                // Another thread claimed the slot first.
+                if (k == key)
+                    return entries_[i].values;
+            }
+        }
+    }
+
+    // Call f(key, values) for every key; not safe against concurrent inserts.
+    template <class F>
+    void ForEach(F f) const
+    {
+        if (has_empty_key_.load(std::memory_order_acquire))
+            f(kEmpty, empty_key_entry_.values);
+        for (size_t i = 0; i < capacity_; i++)
+        {
+            const uint64_t k = entries_[i].key.load(std::memory_order_relaxed);
+            if (k != kEmpty)
+                f(k, entries_[i].values);
+        }
+    }
+
+    static void AtomicAdd(std::atomic<float> &target, float value)
+    {
+        float old = target.load(std::memory_order_relaxed);
+        while (!target.compare_exchange_weak(old, old + value,
+                                             std::memory_order_relaxed))
+        {
+        }
+    }
+
+private:
+    static const uint64_t kEmpty = 0;
+    struct Entry
+    {
+        std::atomic<uint64_t> key;
+        std::atomic<float> values[N];
+    };
+    static void Reset(Entry &entry)
+    {
+        entry.key.store(kEmpty, std::memory_order_relaxed);
+        for (int j = 0; j < N; j++)
+            entry.values[j].store(0.0f, std::memory_order_relaxed);
+    }
+
+    ConcurrentWeightTable(const ConcurrentWeightTable &);
+    ConcurrentWeightTable &operator=(const ConcurrentWeightTable &);
+
+    const size_t capacity_;
+    const size_t mask_;
+    std::unique_ptr<Entry[]> entries_;
+    std::atomic<size_t> size_;
+    Entry empty_key_entry_;
+    std::atomic<bool> has_empty_key_;
+};
+
+#endif // CONCURRENT_WEIGHT_TABLE_H
@@ -0,0 +1,102 @@
+#ifndef MMAP_FILE_H
+#define MMAP_FILE_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+#include "AssertDef.h"
+#include "StringPiece.h"
+
+// Read-only memory mapping of a whole file, unmapped on destruction.
+class MMapFile
+{
+public:
+    explicit MMapFile(const std::string &path) : data_(nullptr), size_(0)
+    {
+        const int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            THROW_ERROR("File not exist! " + path);
+        struct stat st;
+        if (fstat(fd, &st) != 0)
+        {
+            close(fd);
+            THROW_ERROR("Cannot stat file " + path);
+        }
+        size_ = static_cast<size_t>(st.st_size);
+        if (size_ > 0)
+        {
+            void *p = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED)
+            {
+                close(fd);
+                THROW_ERROR("Cannot mmap file " + path);
+            }
+            data_ = static_cast<const char *>(p);
+            madvise(p, size_, MADV_SEQUENTIAL | MADV_WILLNEED);
+        }
+        close(fd);
+    }
+    ~MMapFile()
+    {
+        if (data_ != nullptr)
+            munmap(const_cast<char *>(data_), size_);
+    }
+    const char *data() const { return data_; }
+    size_t size() const { return size_; }
+
+private:
+    MMapFile(const MMapFile &);
+    MMapFile &operator=(const MMapFile &);
+    const char *data_;
+    size_t size_;
+};
+
+// Split [data, data + size) into at most <n> chunks of roughly equal size
+// whose boundaries fall just after a newline, so that no line is cut.
+inline std::vector<std::pair<size_t, size_t>>
+LineAlignedChunks(const char *data, size_t size, size_t n)
+{
+    std::vector<std::pair<size_t, size_t>> chunks;
+    if (n == 0)
+        n = 1;
+    size_t bgn = 0;
+    for (size_t i = 1; i <= n && bgn < size; i++)
+    {
+        size_t end = (i == n) ? size : size / n * i;
+        if (end < bgn)
+            end = bgn;
+        if (end < size)
+        {
+            const void *p = std::memchr(data + end, '\n', size - end);
+            end = (p == nullptr) ? size
+                                 : static_cast<const char *>(p) - data + 1;
+        }
+        if (end > bgn)
+            chunks.emplace_back(bgn, end);
+        bgn = end;
+    }
+    return chunks;
+}
+
+// Call f(line) with a StringPiece for every line of [data, data + size); a
+// final line without a trailing newline is still visited.
+template <class F>
+inline void ForEachLine(const char *data, size_t size, F f)
+{
+    const char *p = data;
+    const char *last = data + size;
+    while (p < last)
+    {
+        const void *q = std::memchr(p, '\n', last - p);
+        const char *eol = (q == nullptr) ? last : static_cast<const char *>(q);
+        f(StringPiece(p, static_cast<size_t>(eol - p)));
+        p = eol + 1;
+    }
+}
+
+#endif // MMAP_FILE_H
@@ -0,0 +1,71 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+// Bounded lock-free ring buffer for exactly one producer thread and one
+// consumer thread. The producer only writes <tail_> and the consumer only
+// writes <head_>; a slot is handed over by the release store of the index
+// that publishes it. The capacity is rounded up to a power of two.
+template <class T>
+class SPSCQueue
+{
+public:
+    explicit SPSCQueue(size_t capacity)
+        : capacity_(RoundUp(capacity)), mask_(capacity_ - 1),
+          buffer_(new T[capacity_]), head_(0), tail_(0) {}
+
+    // Producer side; returns false if the queue is full.
+    bool TryPush(T &&value)
+    {
+        const size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_.load(std::memory_order_acquire) == capacity_)
+            return false;
+        buffer_[tail & mask_] = std::move(value);
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side; returns false if the queue is empty.
+    bool TryPop(T &value)
+    {
+        const size_t head = head_.load(std::memory_order_relaxed);
+        if (head == tail_.load(std::memory_order_acquire))
+            return false;
+        value = std::move(buffer_[head & mask_]);
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    size_t capacity() const { return capacity_; }
+
+private:
+    static size_t RoundUp(size_t n)
+    {
+        size_t c = 1;
+        while (c < n)
+            c <<= 1;
+        return c;
+    }
+
+    SPSCQueue(const SPSCQueue &);
+    SPSCQueue &operator=(const SPSCQueue &);
+
+    const size_t capacity_;
+    const size_t mask_;
+    std::unique_ptr<T[]> buffer_;
+    // Padded onto separate cache lines so that the two threads do not
+    // invalidate each other's index on every operation. By hand rather than
+    // with alignas, which plain new does not honour before C++17.
+    static const size_t kCacheLine = 64;
+    char pad0_[kCacheLine];
+    std::atomic<size_t> head_;
+    char pad1_[kCacheLine - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> tail_;
+    char pad2_[kCacheLine - sizeof(std::atomic<size_t>)];
+};
+
+#endif // SPSC_QUEUE_H
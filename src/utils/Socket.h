@@ -0,0 +1,144 @@
+#ifndef SOCKET_H
+#define SOCKET_H
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <thread>
+#include "AssertDef.h"
+
+// Blocking TCP stream socket, closed on destruction.
+class Socket
+{
+public:
+    explicit Socket(int fd = -1) : fd_(fd) {}
+    Socket(Socket &&other) : fd_(other.fd_) { other.fd_ = -1; }
+    Socket &operator=(Socket &&other)
+    {
+        if (this != &other)
+        {
+            Close();
+            fd_ = other.fd_;
+            other.fd_ = -1;
+        }
+        return *this;
+    }
+    ~Socket() { Close(); }
+    bool valid() const { return fd_ >= 0; }
+
+    // Connect to <host>:<port>, retrying for up to <timeout> seconds while
+    // nobody listens there yet.
+    static Socket Connect(const std::string &host, int port, int timeout)
+    {
+        const auto deadline =
+            std::chrono::steady_clock::now() + std::chrono::seconds(timeout);
+        while (true)
+        {
+            struct addrinfo hints;
+            std::memset(&hints, 0, sizeof(hints));
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            struct addrinfo *addrs = nullptr;
+            const std::string service = std::to_string(port);
+            if (getaddrinfo(host.c_str(), service.c_str(), &hints, &addrs) != 0)
+                THROW_ERROR("Cannot resolve host " + host);
+            for (struct addrinfo *a = addrs; a != nullptr; a = a->ai_next)
+            {
+                Socket socket(::socket(a->ai_family, a->ai_socktype, a->ai_protocol));
+                if (socket.valid() && connect(socket.fd_, a->ai_addr, a->ai_addrlen) == 0)
+                {
+                    freeaddrinfo(addrs);
+                    socket.SetNoDelay();
+                    return socket;
+                }
+            }
+            freeaddrinfo(addrs);
+            if (std::chrono::steady_clock::now() > deadline)
+                THROW_ERROR("Cannot connect to " + host + ":" + service);
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+    }
+
+    // Listen on <port> of every local address.
+    static Socket Listen(int port, int backlog)
+    {
+        Socket socket(::socket(AF_INET, SOCK_STREAM, 0));
+        if (!socket.valid())
+            THROW_ERROR("Cannot create socket: " + std::string(std::strerror(errno)));
+        const int on = 1;
+        setsockopt(socket.fd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        struct sockaddr_in addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(static_cast<uint16_t>(port));
+        if (bind(socket.fd_, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0 ||
+            listen(socket.fd_, backlog) != 0)
+            THROW_ERROR("Cannot listen on port " + std::to_string(port) + ": " +
+                        std::strerror(errno));
+        return socket;
+    }
+
+    Socket Accept() const
+    {
+        Socket socket(accept(fd_, nullptr, nullptr));
+        if (!socket.valid())
+            THROW_ERROR("Cannot accept connection: " + std::string(std::strerror(errno)));
+        socket.SetNoDelay();
+        return socket;
+    }
+
+    void SendAll(const void *data, size_t size) const
+    {
+        const char *p = static_cast<const char *>(data);
+        while (size > 0)
+        {
+            const ssize_t n = send(fd_, p, size, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                THROW_ERROR("Connection lost while sending: " + std::string(std::strerror(errno)));
+            p += n;
+            size -= static_cast<size_t>(n);
+        }
+    }
+
+    void RecvAll(void *data, size_t size) const
+    {
+        char *p = static_cast<char *>(data);
+        while (size > 0)
+        {
+            const ssize_t n = recv(fd_, p, size, 0);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                THROW_ERROR("Connection lost while receiving.");
+            p += n;
+            size -= static_cast<size_t>(n);
+        }
+    }
+
+private:
+    Socket(const Socket &);
+    Socket &operator=(const Socket &);
+    void SetNoDelay()
+    {
+        const int on = 1;
+        setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+    void Close()
+    {
+        if (fd_ >= 0)
+            close(fd_);
+        fd_ = -1;
+    }
+    int fd_;
+};
+
+#endif // SOCKET_H
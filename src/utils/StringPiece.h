@@ -0,0 +1,115 @@
+#ifndef STRING_PIECE_H
+#define STRING_PIECE_H
+
+#include <cstddef>
+#include <cstring>
+#include <string>
+
+// A non-owning view of a character range (C++11 stand-in for
+// std::string_view), used to tokenize memory-mapped input in place.
+class StringPiece
+{
+public:
+    StringPiece() : ptr_(nullptr), length_(0) {}
+    StringPiece(const char *ptr, size_t length) : ptr_(ptr), length_(length) {}
+    StringPiece(const std::string &str) : ptr_(str.data()), length_(str.size()) {}
+    StringPiece(const char *str) : ptr_(str), length_(std::strlen(str)) {}
+
+    const char *data() const { return ptr_; }
+    size_t size() const { return length_; }
+    bool empty() const { return length_ == 0; }
+    const char *begin() const { return ptr_; }
+    const char *end() const { return ptr_ + length_; }
+    char operator[](size_t i) const { return ptr_[i]; }
+
+    StringPiece substr(size_t pos, size_t n = std::string::npos) const
+    {
+        if (pos > length_)
+            pos = length_;
+        if (n > length_ - pos)
+            n = length_ - pos;
+        return StringPiece(ptr_ + pos, n);
+    }
+    size_t find(char c, size_t pos = 0) const
+    {
+        if (pos >= length_)
+            return std::string::npos;
+        const void *p = std::memchr(ptr_ + pos, c, length_ - pos);
+        return p == nullptr ? std::string::npos
+                            : static_cast<const char *>(p) - ptr_;
+    }
+    size_t find(const StringPiece &s, size_t pos = 0) const
+    {
+        if (s.length_ == 0)
+            return pos <= length_ ? pos : std::string::npos;
+        for (size_t i = pos; i + s.length_ <= length_; i++)
+        {
+            i = find(s.ptr_[0], i);
+            if (i == std::string::npos || i + s.length_ > length_)
+                return std::string::npos;
+            if (std::memcmp(ptr_ + i, s.ptr_, s.length_) == 0)
+                return i;
+        }
+        return std::string::npos;
+    }
+    bool operator==(const StringPiece &rhs) const
+    {
+        return length_ == rhs.length_ &&
+               (length_ == 0 || std::memcmp(ptr_, rhs.ptr_, length_) == 0);
+    }
+    bool operator!=(const StringPiece &rhs) const { return !(*this == rhs); }
+    std::string ToString() const { return std::string(ptr_, length_); }
+
+private:
+    const char *ptr_;
+    size_t length_;
+};
+
+// Iterate over the <delim>-separated fields of a piece, keeping empty fields
+// so that the result matches StringSplit().
+class PieceSplitter
+{
+public:
+    PieceSplitter(const StringPiece &str, char delim)
+        : rest_(str), delim_(delim), done_(false) {}
+    bool Next(StringPiece &field)
+    {
+        if (done_)
+            return false;
+        const size_t q = rest_.find(delim_);
+        if (q == std::string::npos)
+        {
+            field = rest_;
+            done_ = true;
+        }
+        else
+        {
+            field = rest_.substr(0, q);
+            rest_ = rest_.substr(q + 1);
+        }
+        return true;
+    }
+
+private:
+    StringPiece rest_;
+    char delim_;
+    bool done_;
+};
+
+// Parse a non-negative decimal integer; returns false on malformed input.
+inline bool ParseNonNegative(const StringPiece &s, int &value)
+{
+    if (s.empty())
+        return false;
+    int v = 0;
+    for (const char c : s)
+    {
+        if (c < '0' || c > '9')
+            return false;
+        v = v * 10 + (c - '0');
+    }
+    value = v;
+    return true;
+}
+
+#endif // STRING_PIECE_H
@@ -0,0 +1,213 @@
+// Differential test of Constraint::CreateFromString against the
+// std::set-based builder it replaced: both must accept the same
+// alignments and assign the same target order. The alignments are the
+// fixture files given as arguments followed by random ones.
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <set>
+#include <sstream>
+#include "Constraint.h"
+
+namespace legacy
+{
+
+typedef std::vector<std::set<int>> Alignment;
+
+bool LessOrEqualAlignment(const std::set<int> &lhs, const std::set<int> &rhs)
+{
+    for (auto &x : lhs)
+        if (rhs.find(x) == rhs.end())
+            for (auto &y : rhs)
+                if (x > y)
+                    return false;
+    for (auto &y : rhs)
+        if (lhs.find(y) == lhs.end())
+            for (auto &x : lhs)
+                if (x > y)
+                    return false;
+    return true;
+}
+
+bool ParseAlignment(const std::string &line, Alignment &alignment)
+{
+    const std::vector<std::string> &parts = StringSplit(line, " ||| ");
+    if (parts[1].empty())
+        return false;
+    const size_t sourceSize = std::stoul(StringSplit(parts[0], "-")[0]);
+    alignment.assign(sourceSize, std::set<int>());
+    for (const std::string &token : StringSplit(parts[1], " "))
+    {
+        const std::vector<std::string> &indices = StringSplit(token, "-");
+        alignment[std::stoi(indices[0])].insert(std::stoi(indices[1]));
+    }
+    return true;
+}
+
+bool CheckBTGParsable(const std::vector<int> &constraint)
+{
+    std::vector<int> positions;
+    for (size_t i = 0; i + 1 < constraint.size(); i++)
+    {
+        if (constraint[i] >= 0)
+            positions.push_back(constraint[i]);
+    }
+    std::vector<int> lmin(positions.size()), lmax(positions.size());
+    std::vector<int> rmin(positions.size()), rmax(positions.size());
+    std::vector<std::pair<int, int>> stack;
+    stack.push_back({0, static_cast<int>(positions.size())});
+    while (!stack.empty())
+    {
+        const auto span = stack.back();
+        stack.pop_back();
+        const int n = span.second - span.first;
+        for (int i = 0; i < n; i++)
+        {
+            const int p = positions[span.first + i];
+            lmin[i] = i == 0 ? p : std::min(lmin[i - 1], p);
+            lmax[i] = i == 0 ? p : std::max(lmax[i - 1], p);
+        }
+        for (int i = n - 1; i >= 0; i--)
+        {
+            const int p = positions[span.first + i];
+            rmin[i] = i == n - 1 ? p : std::min(rmin[i + 1], p);
+            rmax[i] = i == n - 1 ? p : std::max(rmax[i + 1], p);
+        }
+        int split = -1;
+        for (int i = 1; i < n; i++)
+        {
+            if (lmax[i - 1] <= rmin[i] || rmax[i] <= lmin[i - 1])
+            {
+                split = i;
+                break;
+            }
+        }
+        if (split < 0)
+            return false;
+        const int third = span.first + split;
+        if (third - span.first > 1)
+            stack.push_back({span.first, third});
+        if (span.second - third > 1)
+            stack.push_back({third, span.second});
+    }
+    return true;
+}
+
+// The target order of every source word, then the number of groups; false
+// where the old builder returned no constraint.
+bool CreateFromString(const std::string &line, std::vector<int> &constraint)
+{
+    Alignment alignment;
+    if (!ParseAlignment(line, alignment))
+        return false;
+    std::vector<std::vector<int>> sorted_indices;
+    for (size_t i = 0; i < alignment.size(); i++)
+    {
+        if (alignment[i].empty())
+            continue;
+        bool eq = false;
+        size_t j;
+        for (j = 0; j < sorted_indices.size(); j++)
+        {
+            const std::set<int> &other = alignment[sorted_indices[j].front()];
+            const bool le = LessOrEqualAlignment(alignment[i], other);
+            const bool ge = LessOrEqualAlignment(other, alignment[i]);
+            if (!le && !ge)
+                return false;
+            eq = (le && ge);
+            if (le)
+                break;
+        }
+        if (!eq)
+            sorted_indices.insert(sorted_indices.begin() + j, std::vector<int>());
+        sorted_indices[j].push_back(i);
+    }
+    constraint.assign(alignment.size(), -1);
+    for (size_t i = 0; i < sorted_indices.size(); i++)
+        for (const int j : sorted_indices[i])
+            constraint[j] = i;
+    constraint.push_back(sorted_indices.size());
+    return CheckBTGParsable(constraint);
+}
+
+} // namespace legacy
+
+// A random alignment of <n> source words: a permutation made of a few
+// swapped blocks, some words unaligned and some with extra links nearby,
+// or with <noisy> just random links.
+std::string RandomAlignment(std::mt19937 &rng, int n, bool noisy)
+{
+    std::vector<int> order(n);
+    for (int i = 0; i < n; i++)
+        order[i] = i;
+    const int swaps = std::uniform_int_distribution<int>(0, 3)(rng);
+    for (int k = 0; k < swaps; k++)
+    {
+        const int a = std::uniform_int_distribution<int>(0, n - 1)(rng);
+        const int b = std::uniform_int_distribution<int>(a, n - 1)(rng);
+        const int c = std::uniform_int_distribution<int>(b, n - 1)(rng);
+        std::rotate(order.begin() + a, order.begin() + b, order.begin() + c);
+    }
+    std::uniform_int_distribution<int> percent(0, 99);
+    std::uniform_int_distribution<int> target(0, n - 1);
+    std::ostringstream line;
+    line << n << "-" << n << " |||";
+    int links = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (noisy)
+        {
+            for (int k = percent(rng) % 4; k > 0; k--, links++)
+                line << " " << i << "-" << target(rng);
+            continue;
+        }
+        if (percent(rng) < 10)
+            continue;
+        line << " " << i << "-" << order[i];
+        links++;
+        if (percent(rng) < 15)
+            line << " " << i << "-" << std::min(n - 1, order[i] + 1 + percent(rng) % 2);
+    }
+    if (links == 0)
+        line << " 0-0";
+    return line.str();
+}
+
+bool Compare(const std::string &line)
+{
+    std::vector<int> expected;
+    const bool parsable = legacy::CreateFromString(line, expected);
+    std::unique_ptr<HieraParser::Constraint> actual(
+        HieraParser::Constraint::CreateFromString(line));
+    if (parsable == (actual != nullptr) &&
+        (!parsable || expected == static_cast<std::vector<int> &>(*actual)))
+        return true;
+    std::cerr << "Constraints differ for: " << line << std::endl;
+    return false;
+}
+
+int main(int argc, char **argv)
+{
+    int cases = 0;
+    int failures = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        std::ifstream file(argv[i]);
+        std::string line;
+        while (std::getline(file, line))
+        {
+            cases++;
+            failures += !Compare(line);
+        }
+    }
+    std::mt19937 rng(29);
+    for (int i = 0; i < 20000; i++)
+    {
+        const int n = std::uniform_int_distribution<int>(1, 60)(rng);
+        cases++;
+        failures += !Compare(RandomAlignment(rng, n, i % 4 == 0));
+    }
+    std::cerr << failures << " of " << cases << " alignments differ." << std::endl;
+    return failures == 0 ? 0 : 1;
+}
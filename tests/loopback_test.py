@@ -0,0 +1,65 @@
+#!/usr/bin/env python3
+###############################################
+# Usage: ./loopback_test.py bin_dir train.annot train.align
+#
+# Trains strategies 2 and 3 as two processes that mix over TCP on
+# localhost (-world 2) and as one process with two threads, and checks
+# that both write the same weights.
+###############################################
+
+import os
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+
+
+def read_model(path):
+	# The magic, then for each label the number of entries and the
+	# (feature, weight) entries, in no particular order.
+	data = open(path, "rb").read()
+	offset = 8 if data[:8] == b"HIPMODL2" else 0
+	weights = []
+	for label in range(2):
+		count, = struct.unpack_from("<Q", data, offset)
+		offset += 8
+		weights.append(dict(struct.iter_unpack("<Qf", data[offset:offset + 12 * count])))
+		offset += 12 * count
+	return weights
+
+
+def free_port():
+	s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+	s.bind(("127.0.0.1", 0))
+	port = s.getsockname()[1]
+	s.close()
+	return port
+
+
+def main():
+	bin_dir, annot, align = sys.argv[1:4]
+	train = os.path.join(bin_dir, "train")
+	tmp = tempfile.mkdtemp()
+	failures = 0
+	for strategy in ("2", "3"):
+		args = [train, "-input", annot, "-align", align, "-strategy", strategy,
+				"-iterations", "3", "-shuffle", "false", "-seed", "7"]
+		single = os.path.join(tmp, "single%s.model" % strategy)
+		subprocess.check_call(args + ["-model", single, "-threads", "2"],
+							  stderr=subprocess.DEVNULL)
+		multi = os.path.join(tmp, "multi%s.model" % strategy)
+		coordinator = "127.0.0.1:%d" % free_port()
+		net = args + ["-model", multi, "-world", "2", "-coordinator", coordinator]
+		worker = subprocess.Popen(net + ["-rank", "1"], stderr=subprocess.DEVNULL)
+		subprocess.check_call(net + ["-rank", "0"], stderr=subprocess.DEVNULL)
+		if worker.wait() != 0:
+			sys.exit("strategy %s: process 1 failed" % strategy)
+		same = read_model(single) == read_model(multi)
+		print("strategy %s: %s" % (strategy, "same" if same else "DIFFERENT"))
+		failures += not same
+	sys.exit(1 if failures else 0)
+
+
+if __name__ == "__main__":
+	main()
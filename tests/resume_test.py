@@ -0,0 +1,75 @@
+#!/usr/bin/env python3
+###############################################
+# Usage: ./resume_test.py bin_dir train.annot train.align
+#
+# Trains strategies 0-3 with -checkpoint, cuts the checkpoint back to an
+# earlier iteration as a process killed then would have left it, and
+# checks that -resume from there writes the same weights as the
+# uninterrupted run.
+###############################################
+
+import os
+import shutil
+import struct
+import subprocess
+import sys
+import tempfile
+
+# Keep the source tree free of bytecode.
+sys.dont_write_bytecode = True
+from loopback_test import read_model  # noqa: E402
+
+# The head of an increment in the checkpoint log: magic, epoch, reserved,
+# seed, number of counters, number of models, then the bytes that follow
+# up to the 8-byte end marker.
+SEGMENT = struct.Struct("<8siiQQQQ")
+
+
+def segments(log):
+	# The end offset and epoch of every complete increment of <log>.
+	data = open(log, "rb").read()
+	offset = 0
+	result = []
+	while offset + SEGMENT.size <= len(data):
+		fields = SEGMENT.unpack_from(data, offset)
+		offset += SEGMENT.size + fields[6] + 8
+		result.append((offset, fields[1]))
+	return result
+
+
+def main():
+	bin_dir, annot, align = sys.argv[1:4]
+	train = os.path.join(bin_dir, "train")
+	tmp = tempfile.mkdtemp()
+	failures = 0
+	for strategy in ("0", "1", "2", "3"):
+		args = [train, "-input", annot, "-align", align, "-strategy", strategy,
+				"-iterations", "4", "-shuffle", "false", "-seed", "7", "-threads", "2"]
+		full = os.path.join(tmp, "full%s.model" % strategy)
+		checkpoint = os.path.join(tmp, "full%s.ckpt" % strategy)
+		subprocess.check_call(args + ["-model", full, "-checkpoint", checkpoint],
+							  stderr=subprocess.DEVNULL)
+		ends = segments(checkpoint + ".log")
+		if len(ends) < 2:
+			sys.exit("strategy %s: the checkpoint log has too few increments" % strategy)
+		snapshot = struct.unpack_from("<i", open(checkpoint, "rb").read(24), 20)[0]
+		# Resume from the snapshot alone, and from the first increment with
+		# half of the second one torn off.
+		torn = ends[0][0] + (ends[1][0] - ends[0][0]) // 2
+		for keep, epoch in ((0, snapshot), (torn, ends[0][1])):
+			resumed = os.path.join(tmp, "resumed%s.model" % strategy)
+			cut = os.path.join(tmp, "resumed%s.ckpt" % strategy)
+			shutil.copyfile(checkpoint, cut)
+			shutil.copyfile(checkpoint + ".log", cut + ".log")
+			os.truncate(cut + ".log", keep)
+			subprocess.check_call(args + ["-model", resumed, "-checkpoint", cut, "-resume"],
+								  stderr=subprocess.DEVNULL)
+			same = read_model(full) == read_model(resumed)
+			print("strategy %s from iteration %d: %s" % (strategy, epoch, "same" if same else "DIFFERENT"))
+			failures += not same
+	shutil.rmtree(tmp)
+	sys.exit(1 if failures else 0)
+
+
+if __name__ == "__main__":
+	main()